@@ -48,7 +48,15 @@
 #include <linux/cpumask.h>
 
 #define __MSR_IA32_PMC0				0x0C1
+#define __MSR_IA32_PMC1				0x0C2
+#define __MSR_IA32_PMC2				0x0C3
+#define __MSR_IA32_PMC3				0x0C4
 #define __MSR_IA32_PERFEVTSEL0			0x186
+#define __MSR_IA32_PERFEVTSEL1			0x187
+#define __MSR_IA32_PERFEVTSEL2			0x188
+#define __MSR_IA32_PERFEVTSEL3			0x189
+#define __MSR_OFFCORE_RSP_0			0x1A6
+#define __MSR_OFFCORE_RSP_1			0x1A7
 #define __MSR_CORE_PERF_GLOBAL_STATUS		0x38E
 #define __MSR_CORE_PERF_GLOBAL_CTRL		0x38F
 
@@ -100,6 +108,44 @@ const static u64 predefined_event_map[EVENT_COUNT_MAX] =
 	[BRANCH_MISSES_RETIRED]		= 0x00c5,
 };
 
+/*
+ * Haswell events used by the NVM emulator
+ *
+ * CYCLE_ACTIVITY.STALLS_L2_PENDING: Execution stalls due to L2 cache misses.
+ * Together with CMASK=5 it counts cycles the core is stalled while at least
+ * one L2 miss demand load is outstanding. This is the memory-stall time on
+ * the critical path, overlapped misses are counted only once.
+ */
+#define HSW_CYCLE_ACTIVITY_STALLS_L2_PENDING	(0x05a3 | CMASK(5))
+
+/*
+ * OFFCORE_RESPONSE_0/1: Offcore requests, filtered by request type and
+ * response type through __MSR_OFFCORE_RSP_0/1. Unlike uncore events, they
+ * are counted per logical cpu, so every core knows its own remote misses.
+ *
+ * ALL_DATA_RD.LLC_MISS.REMOTE_DRAM:	0x063F800091
+ * ALL_RFO.LLC_MISS.REMOTE_DRAM:	0x063F800122
+ *
+ * We have no way to see writebacks per core, RFOs that miss to remote DRAM
+ * are the closest thing: every such line will be written back later.
+ */
+#define HSW_OFFCORE_RESPONSE_0			0x01b7
+#define HSW_OFFCORE_RESPONSE_1			0x01bb
+#define HSW_OFFCORE_ALL_DATA_RD_REMOTE_DRAM	0x063F800091ULL
+#define HSW_OFFCORE_ALL_RFO_REMOTE_DRAM		0x063F800122ULL
+
+/* PMC0 is taken by LLC_MISSES sampling, stalls are counted by PMC1 */
+#define STALL_PMC				__MSR_IA32_PMC1
+#define STALL_PERFEVTSEL			__MSR_IA32_PERFEVTSEL1
+#define STALL_GLOBAL_CTRL_BIT			(1ULL<<1)
+
+/* Remote reads by PMC2, remote RFOs by PMC3 */
+#define OFFCORE_RD_PMC				__MSR_IA32_PMC2
+#define OFFCORE_RD_PERFEVTSEL			__MSR_IA32_PERFEVTSEL2
+#define OFFCORE_WR_PMC				__MSR_IA32_PMC3
+#define OFFCORE_WR_PERFEVTSEL			__MSR_IA32_PERFEVTSEL3
+#define OFFCORE_GLOBAL_CTRL_BITS		((1ULL<<2) | (1ULL<<3))
+
 /* PMU information */
 static u32  PERF_VERSION;
 static u32  PC_PER_CPU;
@@ -253,11 +299,18 @@ static void __core_pmu_show_msrs(void *info)
 		smp_processor_id(), tmsr1, tmsr2, tmsr3);
 }
 
+/*
+ * Only bit 0 of __MSR_CORE_PERF_GLOBAL_CTRL belongs to us, the other
+ * counters may be used by the NVM emulator at the same time.
+ */
 static void __core_pmu_clear_msrs(void *info)
 {
+	u64 ctrl;
+
 	core_pmu_wrmsr(__MSR_IA32_PMC0, 0x0);
 	core_pmu_wrmsr(__MSR_IA32_PERFEVTSEL0, 0x0);
-	core_pmu_wrmsr(__MSR_CORE_PERF_GLOBAL_CTRL, 0x0);
+	ctrl = core_pmu_rdmsr(__MSR_CORE_PERF_GLOBAL_CTRL);
+	core_pmu_wrmsr(__MSR_CORE_PERF_GLOBAL_CTRL, ctrl & ~1ULL);
 	core_pmu_wrmsr(__MSR_CORE_PERF_GLOBAL_OVF_CTRL, 0x0);
 }
 
@@ -273,12 +326,16 @@ static void __core_pmu_clear_msrs(void *info)
  */
 static void __core_pmu_enable_counting(void *info)
 {
-	core_pmu_wrmsr(__MSR_CORE_PERF_GLOBAL_CTRL, 1);
+	u64 ctrl = core_pmu_rdmsr(__MSR_CORE_PERF_GLOBAL_CTRL);
+
+	core_pmu_wrmsr(__MSR_CORE_PERF_GLOBAL_CTRL, ctrl | 1);
 }
 
 static void __core_pmu_disable_counting(void *info)
 {
-	core_pmu_wrmsr(__MSR_CORE_PERF_GLOBAL_CTRL, 0);
+	u64 ctrl = core_pmu_rdmsr(__MSR_CORE_PERF_GLOBAL_CTRL);
+
+	core_pmu_wrmsr(__MSR_CORE_PERF_GLOBAL_CTRL, ctrl & ~1ULL);
 }
 
 static void __core_pmu_clear_ovf(void *info)
@@ -390,6 +447,144 @@ static void core_pmu_lapic_init(void)
 	}
 }
 
+//#################################################
+//	Memory Stall Counting
+//#################################################
+
+/*
+ * The NVM emulator (uncore.ko) scales its injected delay by the cycles the
+ * emulated cpu really stalled on memory. PMC1 counts these stall cycles,
+ * the emulator fetches and clears it once per epoch on the emulated cpu.
+ */
+
+static void __core_pmu_enable_stall_counting(void *info)
+{
+	u64 ctrl;
+
+	core_pmu_wrmsr(STALL_PMC, 0);
+	core_pmu_wrmsr(STALL_PERFEVTSEL,
+				HSW_CYCLE_ACTIVITY_STALLS_L2_PENDING
+				| USR_MODE
+				| OS_MODE
+				| ENABLE );
+	ctrl = core_pmu_rdmsr(__MSR_CORE_PERF_GLOBAL_CTRL);
+	core_pmu_wrmsr(__MSR_CORE_PERF_GLOBAL_CTRL, ctrl | STALL_GLOBAL_CTRL_BIT);
+}
+
+static void __core_pmu_disable_stall_counting(void *info)
+{
+	u64 ctrl;
+
+	ctrl = core_pmu_rdmsr(__MSR_CORE_PERF_GLOBAL_CTRL);
+	core_pmu_wrmsr(__MSR_CORE_PERF_GLOBAL_CTRL, ctrl & ~STALL_GLOBAL_CTRL_BIT);
+	core_pmu_wrmsr(STALL_PERFEVTSEL, 0);
+	core_pmu_wrmsr(STALL_PMC, 0);
+}
+
+void core_pmu_enable_stall_counting(int cpu)
+{
+	core_pmu_cpu_function_call(cpu, __core_pmu_enable_stall_counting, NULL);
+}
+EXPORT_SYMBOL(core_pmu_enable_stall_counting);
+
+void core_pmu_disable_stall_counting(int cpu)
+{
+	core_pmu_cpu_function_call(cpu, __core_pmu_disable_stall_counting, NULL);
+}
+EXPORT_SYMBOL(core_pmu_disable_stall_counting);
+
+/**
+ * core_pmu_fetch_stall_cycles
+ * Return:	memory stall cycles since last fetch on *this* cpu
+ *
+ * Read and clear the stall counter. Must be called with preemption disabled,
+ * on the cpu that enabled stall counting.
+ */
+u64 core_pmu_fetch_stall_cycles(void)
+{
+	u64 cycles;
+
+	cycles = core_pmu_rdmsr(STALL_PMC);
+	core_pmu_wrmsr(STALL_PMC, 0);
+
+	return cycles & ((1ULL<<48)-1);
+}
+EXPORT_SYMBOL(core_pmu_fetch_stall_cycles);
+
+//#################################################
+//	Offcore Remote DRAM Counting
+//#################################################
+
+/*
+ * The uncore HA box can not tell which core a request comes from, so the
+ * emulator had to offline all cpus but one. Offcore response events are
+ * counted per cpu, which let the emulator attribute remote misses to every
+ * emulated cpu and inject each its own delay.
+ */
+
+static void __core_pmu_enable_offcore_counting(void *info)
+{
+	u64 ctrl;
+
+	core_pmu_wrmsr(OFFCORE_RD_PMC, 0);
+	core_pmu_wrmsr(OFFCORE_WR_PMC, 0);
+	core_pmu_wrmsr(__MSR_OFFCORE_RSP_0, HSW_OFFCORE_ALL_DATA_RD_REMOTE_DRAM);
+	core_pmu_wrmsr(__MSR_OFFCORE_RSP_1, HSW_OFFCORE_ALL_RFO_REMOTE_DRAM);
+	core_pmu_wrmsr(OFFCORE_RD_PERFEVTSEL,
+				HSW_OFFCORE_RESPONSE_0
+				| USR_MODE
+				| OS_MODE
+				| ENABLE );
+	core_pmu_wrmsr(OFFCORE_WR_PERFEVTSEL,
+				HSW_OFFCORE_RESPONSE_1
+				| USR_MODE
+				| OS_MODE
+				| ENABLE );
+	ctrl = core_pmu_rdmsr(__MSR_CORE_PERF_GLOBAL_CTRL);
+	core_pmu_wrmsr(__MSR_CORE_PERF_GLOBAL_CTRL, ctrl | OFFCORE_GLOBAL_CTRL_BITS);
+}
+
+static void __core_pmu_disable_offcore_counting(void *info)
+{
+	u64 ctrl;
+
+	ctrl = core_pmu_rdmsr(__MSR_CORE_PERF_GLOBAL_CTRL);
+	core_pmu_wrmsr(__MSR_CORE_PERF_GLOBAL_CTRL, ctrl & ~OFFCORE_GLOBAL_CTRL_BITS);
+	core_pmu_wrmsr(OFFCORE_RD_PERFEVTSEL, 0);
+	core_pmu_wrmsr(OFFCORE_WR_PERFEVTSEL, 0);
+	core_pmu_wrmsr(__MSR_OFFCORE_RSP_0, 0);
+	core_pmu_wrmsr(__MSR_OFFCORE_RSP_1, 0);
+}
+
+void core_pmu_enable_offcore_counting(int cpu)
+{
+	core_pmu_cpu_function_call(cpu, __core_pmu_enable_offcore_counting, NULL);
+}
+EXPORT_SYMBOL(core_pmu_enable_offcore_counting);
+
+void core_pmu_disable_offcore_counting(int cpu)
+{
+	core_pmu_cpu_function_call(cpu, __core_pmu_disable_offcore_counting, NULL);
+}
+EXPORT_SYMBOL(core_pmu_disable_offcore_counting);
+
+/**
+ * core_pmu_fetch_offcore_counts
+ * @reads:	place to hold remote DRAM reads since last fetch
+ * @writes:	place to hold remote DRAM RFOs since last fetch
+ *
+ * Read and clear the offcore counters of *this* cpu. Must be called with
+ * preemption disabled, on the cpu that enabled offcore counting.
+ */
+void core_pmu_fetch_offcore_counts(u64 *reads, u64 *writes)
+{
+	*reads = core_pmu_rdmsr(OFFCORE_RD_PMC) & ((1ULL<<48)-1);
+	*writes = core_pmu_rdmsr(OFFCORE_WR_PMC) & ((1ULL<<48)-1);
+	core_pmu_wrmsr(OFFCORE_RD_PMC, 0);
+	core_pmu_wrmsr(OFFCORE_WR_PMC, 0);
+}
+EXPORT_SYMBOL(core_pmu_fetch_offcore_counts);
+
 //#################################################
 //	PMU NMI Handler
 //#################################################
@@ -80,6 +80,16 @@ void core_pmu_enable_predefined_event(int event, u64 threshold);
 void core_pmu_start_sampling(void);
 void core_pmu_clear_counter(void);
 
+/* Memory stall counting, used by the NVM emulator */
+void core_pmu_enable_stall_counting(int cpu);
+void core_pmu_disable_stall_counting(int cpu);
+u64 core_pmu_fetch_stall_cycles(void);
+
+/* Per-cpu remote DRAM counting, used by the NVM emulator */
+void core_pmu_enable_offcore_counting(int cpu);
+void core_pmu_disable_offcore_counting(int cpu);
+void core_pmu_fetch_offcore_counts(u64 *reads, u64 *writes);
+
 int core_pmu_proc_create(void);
 void core_pmu_proc_remove(void);
 
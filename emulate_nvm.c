@@ -18,39 +18,261 @@
 
 #define pr_fmt(fmt) fmt
 
+#include "core_pmu.h"
 #include "uncore_pmu.h"
 #include "emulate_nvm.h"
 
 #include <linux/cpu.h>
+#include <linux/errno.h>
 #include <linux/init.h>
 #include <linux/list.h>
 #include <linux/delay.h>
 #include <linux/types.h>
 #include <linux/kernel.h>
+#include <linux/mutex.h>
+#include <linux/math64.h>
 #include <linux/module.h>
+#include <linux/percpu.h>
+#include <linux/seqlock.h>
+#include <linux/string.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
 
 /* TODO more general. */
 extern struct uncore_event ha_requests_local_reads;
 extern struct uncore_event ha_requests_remote_reads;
+extern struct uncore_event ha_requests_remote_writes;
 
-/* Latency model */
-u64 dram_read_latency_ns;
-u64 nvm_read_latency_ns;
-u64 read_latency_delta_ns;
+/*
+ * One context per emulated NVM node, filled by emulate_nvm_topology_init().
+ * Latency model and epoch length of each of them can be changed at runtime
+ * through /proc/emulate_nvm. Every epoch takes a snapshot under the seqlock of
+ * its context, so a cpu either sees the whole old set or the whole new set,
+ * never a mix.
+ */
+struct emulate_nvm_ctx emulate_nvm_ctxs[EMULATE_NVM_MAX_CTX];
+unsigned int nr_emulate_nvm_ctxs;
 
 unsigned int polling_cpu;
 unsigned int polling_node;
-unsigned int emulate_nvm_cpu;
-unsigned int emulate_nvm_node;
 
-u64 emulate_nvm_hrtimer_duration_ns;
+/*
+ * Per-context latency profile, in context order (i.e. nvm_node order).
+ * 0 means the default one. DRAM latencies are the same for everybody.
+ */
+static unsigned long nvm_read_ns[EMULATE_NVM_MAX_CTX];
+static int nr_nvm_read_ns;
+module_param_array(nvm_read_ns, ulong, &nr_nvm_read_ns, 0444);
+MODULE_PARM_DESC(nvm_read_ns, "NVM read latency in ns of each nvm_node (default: 300)");
+
+static unsigned long nvm_write_ns[EMULATE_NVM_MAX_CTX];
+static int nr_nvm_write_ns;
+module_param_array(nvm_write_ns, ulong, &nr_nvm_write_ns, 0444);
+MODULE_PARM_DESC(nvm_write_ns, "NVM write latency in ns of each nvm_node (default: 1000)");
+
+static unsigned int throttle[EMULATE_NVM_MAX_CTX];
+static int nr_throttle;
+module_param_array(throttle, uint, &nr_throttle, 0444);
+MODULE_PARM_DESC(throttle, "IMC throttle ratio (1, 2 or 4) of each nvm_node, wins over the bandwidth of a profile (default: 1, full bandwidth)");
+
+static unsigned long nvm_bw_mbps[EMULATE_NVM_MAX_CTX];
+static int nr_nvm_bw_mbps;
+module_param_array(nvm_bw_mbps, ulong, &nr_nvm_bw_mbps, 0444);
+MODULE_PARM_DESC(nvm_bw_mbps, "Read bandwidth in MB/s of each nvm_node, exact if calibrated (bw_calibrate or bw_table), else the closest throttle ratio; wins over throttle (default: none)");
+
+static unsigned long nvm_write_bw_mbps[EMULATE_NVM_MAX_CTX];
+static int nr_nvm_write_bw_mbps;
+module_param_array(nvm_write_bw_mbps, ulong, &nr_nvm_write_bw_mbps, 0444);
+MODULE_PARM_DESC(nvm_write_bw_mbps, "Write bandwidth in MB/s of each nvm_node, enforced by write_limit (default: the read bandwidth)");
+
+/* A device profile sets all of the above, explicit ones still win */
+static char *profiles[EMULATE_NVM_MAX_CTX];
+static int nr_profiles;
+module_param_array_named(profile, profiles, charp, &nr_profiles, 0444);
+MODULE_PARM_DESC(profile, "Device profile of each nvm_node: optane, pcm or cxl (default: none)");
+
+unsigned long dram_bw_mbps = 60000;
+module_param(dram_bw_mbps, ulong, 0444);
+MODULE_PARM_DESC(dram_bw_mbps, "Peak bandwidth of an unthrottled NVM node in MB/s (default: 60000)");
+
+/*
+ * Self-hosted mode: the emulated cpu polls the HA box by itself from a pinned
+ * hrtimer and wastes the delay locally. No polling cpu, no IPI.
+ */
+bool self_hosted = true;
+module_param(self_hosted, bool, 0444);
+MODULE_PARM_DESC(self_hosted, "Inject delay from a pinned hrtimer on the emulated cpu, instead of IPIs from the polling cpu (default: true)");
+
+/*
+ * Count memory stall time of the emulated cpus, the mlp latency model needs
+ * it. It is also the default model then, see emulate_nvm_model.c.
+ */
+bool mlp_model = true;
+module_param(mlp_model, bool, 0444);
+MODULE_PARM_DESC(mlp_model, "Scale read delay by core memory stall cycles (default: true)");
+
+/*
+ * Adaptive epoch. A fixed 100ms epoch can dump tens of milliseconds of delay
+ * in one burst, which wrecks tail latency of request/response services. The
+ * controller shortens the epoch of a cpu when it misses a lot, and lengthens
+ * it when it is idle, so the delay injected per epoch stays around
+ * max_stall_ns. The epoch never gets so short that the machinery itself eats
+ * more than overhead_budget (per mille) of cpu time.
+ *
+ * max_stall_ns bounds a single injected stall in any case, the rest is carried
+ * to the next epoch by the delay engine.
+ */
+bool adaptive_epoch = true;
+module_param(adaptive_epoch, bool, 0444);
+MODULE_PARM_DESC(adaptive_epoch, "Adapt epoch length to the miss rate of each cpu (default: true)");
+
+unsigned long min_epoch_ns = 1000000;
+module_param(min_epoch_ns, ulong, 0444);
+MODULE_PARM_DESC(min_epoch_ns, "Shortest adaptive epoch in ns (default: 1ms)");
+
+unsigned long max_epoch_ns = 100000000;
+module_param(max_epoch_ns, ulong, 0444);
+MODULE_PARM_DESC(max_epoch_ns, "Longest adaptive epoch in ns, also the fixed epoch (default: 100ms)");
+
+unsigned long max_stall_ns = 1000000;
+module_param(max_stall_ns, ulong, 0444);
+MODULE_PARM_DESC(max_stall_ns, "Longest single injected stall in ns, 0 for no limit (default: 1ms)");
+
+unsigned int overhead_budget = 10;
+module_param(overhead_budget, uint, 0444);
+MODULE_PARM_DESC(overhead_budget, "Max cpu time spent by the emulation itself, per mille (default: 10)");
+
+/*
+ * How remote requests are attributed to emulated cpus:
+ *
+ * "offcore": every emulated cpu counts its own remote DRAM requests with
+ *            OFFCORE_RESPONSE on its core PMU.
+ * "cbox":    C-Box TOR_INSERTS with TID filter, rotated among emulated cpus,
+ *            see emulate_nvm_cbox.c. Leaves the core PMU alone.
+ * "ha":      the HA box, which can not tell cpus apart, so it can only serve
+ *            a single emulated cpu and everybody else is offlined.
+ *
+ * Per-core modes inject each cpu its own delay from its own pinned hrtimer.
+ * Nothing needs to be offlined.
+ */
+static char *attribution = "offcore";
+module_param(attribution, charp, 0444);
+MODULE_PARM_DESC(attribution, "Remote request attribution: offcore, cbox or ha (default: offcore)");
+
+int attribution_mode;
 
-u64 hrtimer_jiffies;
+static const char *attribution_names[] = {
+	[EMULATE_NVM_ATTR_HA]		= "ha",
+	[EMULATE_NVM_ATTR_OFFCORE]	= "offcore",
+	[EMULATE_NVM_ATTR_CBOX]		= "cbox",
+};
+
+const char *emulate_nvm_attribution_name(void)
+{
+	return attribution_names[attribution_mode];
+}
+
+static int parse_attribution(void)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(attribution_names); i++) {
+		if (!strcmp(attribution, attribution_names[i])) {
+			attribution_mode = i;
+			return 0;
+		}
+	}
+	return -EINVAL;
+}
+
+/* CPUs we inject delay into, changed by emulate_nvm_set_cpus() only */
+struct cpumask emulate_nvm_cpus;
+DEFINE_MUTEX(emulate_nvm_cpus_mutex);
+
+DEFINE_PER_CPU(struct emulate_nvm_cpu_stat, emulate_nvm_cpu_stats);
 
 static bool emulation_started = false;
 static bool latency_started = false;
-static struct uncore_box *HA_Box_0, *HA_Box_1;
-static struct uncore_event *event;
+
+/* Cpus we took offline, and have to bring back */
+static struct cpumask emulate_nvm_offlined;
+
+struct emulate_nvm_delay {
+	u64	reads;
+	u64	writes;
+	u64	delay_ns;	/* Filled by the emulating cpu */
+	u64	delay_cycles;	/* Filled by the emulating cpu */
+	u64	epoch_ns;	/* Filled by the emulating cpu */
+};
+
+/* The context emulating NVM @node, or NULL */
+struct emulate_nvm_ctx *emulate_nvm_find_ctx(int node)
+{
+	struct emulate_nvm_ctx *ctx;
+
+	for_each_emulate_nvm_ctx(ctx) {
+		if (ctx->node == node)
+			return ctx;
+	}
+	return NULL;
+}
+
+/* Take a consistent snapshot of the current parameters of @ctx */
+void emulate_nvm_get_params(struct emulate_nvm_ctx *ctx,
+			    struct emulate_nvm_params *params)
+{
+	unsigned int seq;
+
+	do {
+		seq = read_seqbegin(&ctx->lock);
+		*params = ctx->params;
+	} while (read_seqretry(&ctx->lock, seq));
+}
+
+/**
+ * emulate_nvm_params_valid
+ * @params:	latencies, epoch length and model to check
+ *
+ * NVM must not be faster than DRAM, and the epoch must stay within
+ * [min_epoch_ns, max_epoch_ns]. A hrtimer of a few ns would never let its
+ * cpu run anything else.
+ */
+bool emulate_nvm_params_valid(const struct emulate_nvm_params *params)
+{
+	return params->nvm_read_ns >= params->dram_read_ns &&
+	       params->nvm_write_ns >= params->dram_write_ns &&
+	       params->epoch_ns >= min_epoch_ns &&
+	       params->epoch_ns <= max_epoch_ns &&
+	       params->model && emulate_nvm_model_usable(params->model);
+}
+
+/**
+ * emulate_nvm_set_params
+ * @ctx:	the context to change
+ * @params:	new latencies, epoch length and model, deltas are ignored
+ * Return:	Non-zero on invalid parameters
+ *
+ * Publish a new parameter set. Running hrtimers are left alone, each emulated
+ * cpu picks the new set up at its next epoch boundary.
+ */
+int emulate_nvm_set_params(struct emulate_nvm_ctx *ctx,
+			   struct emulate_nvm_params *params)
+{
+	unsigned long flags;
+
+	if (!emulate_nvm_params_valid(params))
+		return -EINVAL;
+
+	params->read_delta_ns = params->nvm_read_ns - params->dram_read_ns;
+	params->write_delta_ns = params->nvm_write_ns - params->dram_write_ns;
+
+	/* hrtimers read it, do not let them spin on us */
+	write_seqlock_irqsave(&ctx->lock, flags);
+	ctx->params = *params;
+	write_sequnlock_irqrestore(&ctx->lock, flags);
+
+	return 0;
+}
 
 /*
  * Hmm, this is the 'ultimate' emulating function. It is executed in the
@@ -60,95 +282,367 @@ static struct uncore_event *event;
  * We are talking about interrupting a normal running program. But, no flush
  * overhead of cache/tlb/register are considered. It is hard to evaluate how
  * these overhead impact whole system throughput. Anyway, whatever la.
+ *
+ * udelay() used to be the delay function, it truncates to whole microseconds.
+ * emulate_nvm_delay() spins on the TSC and carries the leftover to next epoch.
  */
 static void emulate_nvm_func(void *info)
 {
-	u64 delay_ns = *(u64 *)info;
-	udelay(delay_ns / 1000);
+	struct emulate_nvm_delay *delay = info;
+	struct emulate_nvm_cpu_stat *stat = this_cpu_ptr(&emulate_nvm_cpu_stats);
+	struct emulate_nvm_params params;
+	struct nvm_latency_counts counts;
+	u64 start, now;
+
+	/* New parameters take effect here, at the epoch boundary */
+	emulate_nvm_get_params(stat->ctx, &params);
+	delay->epoch_ns = params.epoch_ns;
+
+	/* DRAM latency of right now, instead of the configured one */
+	if (closed_loop)
+		emulate_nvm_tor_correct(stat->ctx, &params);
+
+	/* What the DRAM of NVM node did, for whoever wants it */
+	if (emulate_nvm_imc_wanted())
+		emulate_nvm_imc_update(stat->ctx);
+
+	/* Reads hitting an open row skip the slow array read */
+	if (row_buffer)
+		emulate_nvm_rowbuf_correct(stat->ctx, &params);
+
+	/* Writes merged in the DIMM buffer never reach the media */
+	if (write_buffer)
+		emulate_nvm_wcb_correct(stat->ctx, &params);
+
+	/* Writes pay for the whole media block they dirty */
+	if (write_amp)
+		params.write_delta_ns += READ_ONCE(stat->ctx->wa_write_ns);
+
+	/* And wait for the media when writing faster than it can */
+	if (write_limit)
+		params.write_delta_ns += READ_ONCE(stat->ctx->wr_limit_ns);
+
+	counts.reads = delay->reads;
+	counts.writes = delay->writes;
+	counts.stall_ns = 0;
+
+	/* Must be read on the emulated cpu itself */
+	if (mlp_model)
+		counts.stall_ns = emulate_nvm_cycles_to_ns(core_pmu_fetch_stall_cycles());
+
+	now = ktime_get_ns();
+	counts.epoch_ns = stat->last_ns ? now - stat->last_ns : params.epoch_ns;
+	stat->last_ns = now;
+
+	delay->delay_ns = params.model->delay_ns(stat->ctx, &params, &counts);
+
+	stat->reads = delay->reads;
+	stat->writes = delay->writes;
+	stat->stall_ns = counts.stall_ns;
+	stat->delay_ns = delay->delay_ns;
+
+	start = core_pmu_rdtsc();
+	emulate_nvm_delay(delay->delay_ns, max_stall_ns);
+	delay->delay_cycles = core_pmu_rdtsc() - start;
 }
 
 /*
- * Hmm, this depends on the emulating model. Anyone who even knows a little
- * about computer architecture should know this model sucks. No modern processor
- * would wait the entire memory read transaction, even read is on the critical
- * path. Why I still do this? I can not tell you why. Sigh.
+ * Reads and writes of this epoch. The box keeps counting all the time, we
+ * only take deltas of the free-running counters. Freezing, reading, zeroing
+ * and un-freezing used to lose the misses in between, and cost twice the
+ * PCI config accesses.
  */
-static inline u64 counts_to_delay_ns(u64 counts)
+static void emulate_nvm_read_box(struct uncore_box *box, u64 *reads, u64 *writes)
 {
-	return (counts * read_latency_delta_ns);
+	*reads = uncore_read_counter_delta(box, HA_READ_CTR);
+	*writes = uncore_read_counter_delta(box, HA_WRITE_CTR);
 }
 
-extern u64 proc_counts;
+/*
+ * Per-epoch overhead of the emulation machinery itself, in TSC cycles. The
+ * delay we inject on purpose is excluded, so all modes are comparable.
+ */
+static inline void account_epoch_overhead(struct emulate_nvm_cpu_stat *stat,
+					  u64 start, u64 delay_cycles)
+{
+	u64 spent = core_pmu_rdtsc() - start;
+
+	if (spent > delay_cycles)
+		stat->overhead_cycles += spent - delay_cycles;
+	stat->epochs++;
+}
+
+/*
+ * The epoch controller. Multiplicative decrease when the last epoch wanted
+ * more than max_stall_ns of delay, so the next one wants about max_stall_ns.
+ * Doubling when it wanted less than a quarter of that (e.g. idle). In between,
+ * leave it alone, otherwise we would oscillate.
+ */
+static u64 emulate_nvm_next_epoch(struct emulate_nvm_cpu_stat *stat,
+				  struct emulate_nvm_delay *delay)
+{
+	u64 epoch_ns = stat->epoch_ns;
+	u64 delay_ns = delay->delay_ns;
+	u64 floor_ns, overhead_ns;
+
+	/* The configured epoch is the fixed one, or the longest adaptive one */
+	if (!adaptive_epoch || !max_stall_ns)
+		return delay->epoch_ns;
+
+	if (delay_ns > max_stall_ns)
+		epoch_ns = div64_u64(epoch_ns * max_stall_ns, delay_ns);
+	else if (delay_ns < max_stall_ns / 4)
+		epoch_ns *= 2;
+
+	/* overhead_ns / epoch_ns must stay below overhead_budget / 1000 */
+	floor_ns = min_epoch_ns;
+	if (overhead_budget && stat->epochs) {
+		overhead_ns = emulate_nvm_cycles_to_ns(
+			div64_u64(stat->overhead_cycles, stat->epochs));
+		floor_ns = max_t(u64, floor_ns,
+			div_u64(overhead_ns * 1000, overhead_budget));
+	}
+
+	return clamp_t(u64, epoch_ns, floor_ns, delay->epoch_ns);
+}
+
+/* The context polled by the hrtimer of @box */
+static struct emulate_nvm_ctx *box_to_ctx(struct uncore_box *box)
+{
+	struct emulate_nvm_ctx *ctx;
+
+	for_each_emulate_nvm_ctx(ctx) {
+		if (ctx->ha_box == box)
+			return ctx;
+	}
+	return NULL;
+}
+
+/**
+ * emulate_nvm_inject
+ * @reads:	remote reads to pay for
+ * @writes:	remote writes to pay for
+ *
+ * Inject the delay of @reads and @writes on *this* cpu, outside of any epoch
+ * timer. Used by overflow sampling, see emulate_nvm_pmi.c.
+ */
+void emulate_nvm_inject(u64 reads, u64 writes)
+{
+	struct emulate_nvm_cpu_stat *stat = this_cpu_ptr(&emulate_nvm_cpu_stats);
+	struct emulate_nvm_delay delay;
+	u64 start;
+
+	start = core_pmu_rdtsc();
+	delay.reads = reads;
+	delay.writes = writes;
+	emulate_nvm_func(&delay);
+	account_epoch_overhead(stat, start, delay.delay_cycles);
+}
 
 static enum hrtimer_restart emulate_nvm_hrtimer(struct hrtimer *hrtimer)
 {
+	struct emulate_nvm_cpu_stat *stat;
+	struct emulate_nvm_ctx *ctx;
 	struct uncore_box *box;
-	u64 counts, delay_ns;
+	struct emulate_nvm_delay delay;
+	u64 start;
 	
+	start = core_pmu_rdtsc();
 	box = container_of(hrtimer, struct uncore_box, hrtimer);
+	ctx = box_to_ctx(box);
+	if (WARN_ON_ONCE(!ctx))
+		return HRTIMER_NORESTART;
 	
 	/*
 	 * Step I:
-	 * a) Freeze counter
-	 * b) Read counter
+	 * Read counter deltas, the box never stops counting
 	 */
-	uncore_disable_box(box);
-	uncore_read_counter(box, &counts);
-	proc_counts = counts;
+	emulate_nvm_read_box(box, &delay.reads, &delay.writes);
 
 	/*
 	 * Step II:
-	 * a) Translate counts to real additional delay
-	 * b) Send delay function to remote emulating cpu
+	 * a) Send delay function to remote emulating cpu
+	 * b) It translates counts to real additional delay there,
+	 *    since the stall counter lives in that cpu
 	 */
-	delay_ns = counts_to_delay_ns(counts);
-	smp_call_function_single(emulate_nvm_cpu, emulate_nvm_func, &delay_ns, 1);
+	delay.delay_ns = 0;
+	delay.delay_cycles = 0;
+	smp_call_function_single(ctx->cpu, emulate_nvm_func, &delay, 1);
 
 	#ifdef verbose
-	pr_info("on cpu %d, delay_ns=%llu, udelay=%llu", smp_processor_id(), delay_ns,
-			delay_ns/1000);
+	pr_info("on cpu %d, delay_ns=%llu, delay_cycles=%llu", smp_processor_id(),
+		delay.delay_ns, delay.delay_cycles);
 	uncore_show_box(box);
 	#endif
 
-	/*
-	 * Step III:
-	 * a) Clear counter
-	 * b) Enable counting
-	 */
-	uncore_write_counter(box, 0);
-	uncore_enable_box(box);
+	stat = per_cpu_ptr(&emulate_nvm_cpu_stats, ctx->cpu);
+	account_epoch_overhead(stat, start, delay.delay_cycles);
+	stat->epoch_ns = emulate_nvm_next_epoch(stat, &delay);
+
+	hrtimer_forward_now(hrtimer, ns_to_ktime(stat->epoch_ns));
+	return HRTIMER_RESTART;
+}
+
+/*
+ * The self-hosted version of emulate_nvm_hrtimer. It runs on the emulated cpu
+ * itself, and wastes the delay right here. The IPI round-trip is gone, and the
+ * polling cpu is free to run something else.
+ *
+ * With per-core attribution, every emulated cpu runs one of these, and counts
+ * come from its own core PMU or from the C-Box leader. Otherwise there is only
+ * one emulated cpu per context, which reads the HA box of its context through
+ * PCI config space (fine from any cpu).
+ */
+static enum hrtimer_restart emulate_nvm_local_hrtimer(struct hrtimer *hrtimer)
+{
+	struct emulate_nvm_cpu_stat *stat;
+	struct emulate_nvm_delay delay;
+	u64 start;
 
-	hrtimer_jiffies++;
+	start = core_pmu_rdtsc();
+	stat = container_of(hrtimer, struct emulate_nvm_cpu_stat, hrtimer);
+
+	switch (attribution_mode) {
+	case EMULATE_NVM_ATTR_OFFCORE:
+		core_pmu_fetch_offcore_counts(&delay.reads, &delay.writes);
+		emulate_nvm_func(&delay);
+		break;
+	case EMULATE_NVM_ATTR_CBOX:
+		if (smp_processor_id() == emulate_nvm_cbox_leader)
+			emulate_nvm_cbox_epoch();
+		delay.reads = emulate_nvm_cbox_fetch_reads();
+		delay.writes = 0;
+		emulate_nvm_func(&delay);
+		break;
+	default:
+		emulate_nvm_read_box(stat->ctx->ha_box, &delay.reads, &delay.writes);
+		emulate_nvm_func(&delay);
+	}
 
-	hrtimer_forward_now(hrtimer, ns_to_ktime(box->hrtimer_duration));
+	account_epoch_overhead(stat, start, delay.delay_cycles);
+	stat->epoch_ns = emulate_nvm_next_epoch(stat, &delay);
+
+	hrtimer_forward_now(hrtimer, ns_to_ktime(stat->epoch_ns));
 	return HRTIMER_RESTART;
 }
 
-static int start_emulate_latency(void)
+/* Must be called on the emulated cpu, the hrtimer is pinned to it */
+static void __emulate_nvm_start_local_hrtimer(void *info)
 {
-	/*
-	 * Home Agent: (Box0, Node0), (Box0, Node1)
-	 */
-	HA_Box_0 = uncore_get_first_box(uncore_pci_type[UNCORE_PCI_HA_ID], 0);
-	HA_Box_1 = uncore_get_first_box(uncore_pci_type[UNCORE_PCI_HA_ID], 1);
-	if (!HA_Box_0 || !HA_Box_1) {
-		pr_err("Get HA Box Failed");
+	struct emulate_nvm_cpu_stat *stat = this_cpu_ptr(&emulate_nvm_cpu_stats);
+	struct hrtimer *hrtimer = &stat->hrtimer;
+
+	hrtimer_init(hrtimer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_PINNED);
+	hrtimer->function = emulate_nvm_local_hrtimer;
+	hrtimer_start(hrtimer, ns_to_ktime(stat->epoch_ns),
+		HRTIMER_MODE_REL_PINNED);
+}
+
+/*
+ * Program the HA box of NVM node of @ctx, reads and writes on two counters.
+ */
+static int start_emulate_latency_ctx(struct emulate_nvm_ctx *ctx)
+{
+	struct uncore_box *box;
+
+	box = uncore_get_first_box(uncore_pci_type[UNCORE_PCI_HA_ID], ctx->node);
+	if (!box) {
+		pr_err("Get HA Box of Node %d Failed", ctx->node);
 		return -ENXIO;
 	}
-	
-	event = &ha_requests_remote_reads;
-	uncore_box_bind_event(HA_Box_1, event);
+	ctx->ha_box = box;
+
+	uncore_box_bind_event(box, &ha_requests_remote_reads);
 
 	/*
 	 * a) Init and reset box
 	 * b) Freeze counter
-	 * c) Set and enable event
+	 * c) Set and enable events, reads and writes on two counters
 	 * d) Un-Freeze, start counting
 	 */
-	uncore_init_box(HA_Box_1);
-	uncore_disable_box(HA_Box_1);
-	uncore_enable_event(HA_Box_1, event);
-	uncore_enable_box(HA_Box_1);
+	uncore_init_box(box);
+	uncore_disable_box(box);
+	uncore_enable_event_idx(box, HA_READ_CTR, &ha_requests_remote_reads);
+	uncore_enable_event_idx(box, HA_WRITE_CTR, &ha_requests_remote_writes);
+	uncore_enable_box(box);
+
+	return 0;
+}
+
+static void finish_emulate_latency_ctx(struct emulate_nvm_ctx *ctx)
+{
+	if (!ctx->ha_box)
+		return;
+
+	uncore_box_cancel_hrtimer(ctx->ha_box);
+
+	/* show some information, if you wanna */
+	uncore_disable_box(ctx->ha_box);
+	uncore_read_counter_delta(ctx->ha_box, HA_READ_CTR);
+	uncore_read_counter_delta(ctx->ha_box, HA_WRITE_CTR);
+	pr_info("Node %d: %llu remote reads, %llu remote writes in total",
+		ctx->node, uncore_read_counter_total(ctx->ha_box, HA_READ_CTR),
+		uncore_read_counter_total(ctx->ha_box, HA_WRITE_CTR));
+	uncore_show_box(ctx->ha_box);
+
+	/* clear the box and exit */
+	uncore_clear_box(ctx->ha_box);
+	ctx->ha_box = NULL;
+}
+
+static int start_emulate_latency(void)
+{
+	struct emulate_nvm_ctx *ctx;
+	int cpu, ret;
+
+	for_each_emulate_nvm_ctx(ctx) {
+		ret = start_emulate_latency_ctx(ctx);
+		if (ret)
+			goto out;
+	}
+
+	if (attribution_mode == EMULATE_NVM_ATTR_CBOX) {
+		ret = emulate_nvm_cbox_init(&emulate_nvm_cpus);
+		if (ret)
+			goto out;
+	}
+
+	/* After C-Box attribution, it resets the boxes */
+	if (closed_loop) {
+		ret = emulate_nvm_tor_init();
+		if (ret)
+			goto out_cbox;
+	}
+
+	/* Only parses the curve, nothing to undo */
+	if (queue_model) {
+		ret = emulate_nvm_queue_init();
+		if (ret)
+			goto out_tor;
+	}
+
+	if (emulate_nvm_imc_wanted()) {
+		ret = emulate_nvm_imc_init();
+		if (ret)
+			goto out_tor;
+	}
+
+	/*
+	 * After bandwidth emulation, it takes the throttle over. The
+	 * throttles are given back by finish_emulate_bandwidth().
+	 */
+	if (bw_control) {
+		ret = emulate_nvm_bwctl_init();
+		if (ret)
+			goto out_imc;
+	}
+
+	for_each_cpu(cpu, &emulate_nvm_cpus) {
+		if (mlp_model)
+			core_pmu_enable_stall_counting(cpu);
+		if (attribution_mode == EMULATE_NVM_ATTR_OFFCORE)
+			core_pmu_enable_offcore_counting(cpu);
+	}
 	
 	/*
 	 * In emulating latency part, the most important thing
@@ -156,81 +650,348 @@ static int start_emulate_latency(void)
 	 * one just collect counts and in case counter overflows.
 	 * But here, we rely on our hrtimer function to send IPI
 	 * to the emulating core, to emulate the slow read latency
-	 * of NVM. Not so hard, huh?
+	 * of NVM. Not so hard, huh? Each context has its own box,
+	 * so its own hrtimer.
+	 *
+	 * In self-hosted mode, the box hrtimer is left alone. The
+	 * emulated cpu arms its own pinned hrtimer instead. Per-core
+	 * attribution is always self-hosted, one timer per cpu.
+	 *
+	 * With overflow sampling, there is no timer at all. The box
+	 * interrupts us every sample_period remote reads.
 	 */
-	uncore_box_change_hrtimer(HA_Box_1, emulate_nvm_hrtimer);
-	uncore_box_change_duration(HA_Box_1, emulate_nvm_hrtimer_duration_ns);
-	uncore_box_start_hrtimer(HA_Box_1);
+	if (emulate_nvm_overflow_sampling()) {
+		ret = emulate_nvm_pmi_start();
+		if (ret)
+			goto out_counting;
+	} else if (self_hosted || emulate_nvm_per_core()) {
+		for_each_cpu(cpu, &emulate_nvm_cpus)
+			smp_call_function_single(cpu,
+				__emulate_nvm_start_local_hrtimer, NULL, 1);
+	} else {
+		for_each_emulate_nvm_ctx(ctx) {
+			uncore_box_change_hrtimer(ctx->ha_box, emulate_nvm_hrtimer);
+			uncore_box_change_duration(ctx->ha_box, ctx->params.epoch_ns);
+			uncore_box_start_hrtimer(ctx->ha_box);
+		}
+	}
 
 	latency_started = true;
 
 	return 0;
+
+	/* Undo in reverse order, pmi_start() cleans up after itself */
+out_counting:
+	for_each_cpu(cpu, &emulate_nvm_cpus) {
+		if (mlp_model)
+			core_pmu_disable_stall_counting(cpu);
+		if (attribution_mode == EMULATE_NVM_ATTR_OFFCORE)
+			core_pmu_disable_offcore_counting(cpu);
+	}
+out_imc:
+	if (emulate_nvm_imc_wanted())
+		emulate_nvm_imc_exit();
+out_tor:
+	if (closed_loop)
+		emulate_nvm_tor_exit();
+out_cbox:
+	if (attribution_mode == EMULATE_NVM_ATTR_CBOX)
+		emulate_nvm_cbox_exit();
+out:
+	for_each_emulate_nvm_ctx(ctx)
+		finish_emulate_latency_ctx(ctx);
+	return ret;
 }
 
 static void finish_emulate_latency(void)
 {
+	struct emulate_nvm_ctx *ctx;
+	int cpu;
+
 	if (latency_started) {
-		/* cancel hrtimer */
-		uncore_box_cancel_hrtimer(HA_Box_0);
-		uncore_box_cancel_hrtimer(HA_Box_1);
-
-		/* show some information, if you wanna */
-		uncore_disable_box(HA_Box_0);
-		uncore_show_box(HA_Box_0);
-		uncore_disable_box(HA_Box_1);
-		uncore_show_box(HA_Box_1);
-		uncore_print_global_pmu(&uncore_pmu);
+		/* cancel hrtimer, or stop the PMIs */
+		mutex_lock(&emulate_nvm_cpus_mutex);
+		if (emulate_nvm_overflow_sampling())
+			emulate_nvm_pmi_stop();
+		else if (self_hosted || emulate_nvm_per_core()) {
+			for_each_cpu(cpu, &emulate_nvm_cpus)
+				hrtimer_cancel(&per_cpu(emulate_nvm_cpu_stats, cpu).hrtimer);
+		}
+
+		for_each_cpu(cpu, &emulate_nvm_cpus) {
+			if (mlp_model)
+				core_pmu_disable_stall_counting(cpu);
+			if (attribution_mode == EMULATE_NVM_ATTR_OFFCORE)
+				core_pmu_disable_offcore_counting(cpu);
+		}
+		mutex_unlock(&emulate_nvm_cpus_mutex);
+
+		if (emulate_nvm_imc_wanted())
+			emulate_nvm_imc_exit();
+		if (closed_loop)
+			emulate_nvm_tor_exit();
+		if (attribution_mode == EMULATE_NVM_ATTR_CBOX)
+			emulate_nvm_cbox_exit();
 
-		/* clear these boxes and exit */
-		uncore_clear_box(HA_Box_0);
-		uncore_clear_box(HA_Box_1);
+		for_each_emulate_nvm_ctx(ctx)
+			finish_emulate_latency_ctx(ctx);
+		uncore_print_global_pmu(&uncore_pmu);
 
 		latency_started = false;
 	}
 }
 
-static int start_emulate_bandwidth(void)
+/**
+ * emulate_nvm_set_cpus
+ * @ctx:	the context to change
+ * @new:	the new set of emulated cpus of @ctx
+ * Return:	Non-zero on failure
+ *
+ * Change the emulated cpus of a context while emulating. Only per-core
+ * attribution modes can do this. Cpus still in the set keep their hrtimers
+ * running. Removed cpus have their hrtimers cancelled and counters stopped,
+ * added ones are armed with the current epoch length of @ctx. A cpu can only
+ * belong to one context, and must sit on the cpu node of @ctx, which is what
+ * calibration measured from.
+ */
+int emulate_nvm_set_cpus(struct emulate_nvm_ctx *ctx, const struct cpumask *new)
 {
-	/* default to full bandwidth */
-	uncore_imc_set_threshold_all(1);
+	struct emulate_nvm_cpu_stat *stat;
+	struct emulate_nvm_params params;
+	int cpu, ret = 0;
+
+	if (!latency_started)
+		return -EBUSY;
+
+	/* HA can not tell cpus apart, C-Box assignment is fixed at start */
+	if (attribution_mode != EMULATE_NVM_ATTR_OFFCORE)
+		return -EOPNOTSUPP;
+
+	if (cpumask_empty(new) || !cpumask_subset(new, cpu_online_mask))
+		return -EINVAL;
+
+	for_each_cpu(cpu, new) {
+		if (cpu_to_node(cpu) != ctx->cpu_node)
+			return -EINVAL;
+	}
+
+	mutex_lock(&emulate_nvm_cpus_mutex);
 
-	/* enable throttling at all nodes */
-	uncore_imc_enable_throttle_all();
+	/* Cpus of other contexts are not ours to take */
+	for_each_cpu(cpu, new) {
+		if (cpumask_test_cpu(cpu, &emulate_nvm_cpus) &&
+		    !cpumask_test_cpu(cpu, &ctx->cpus)) {
+			ret = -EBUSY;
+			goto out;
+		}
+	}
 
+	for_each_cpu(cpu, &ctx->cpus) {
+		if (cpumask_test_cpu(cpu, new))
+			continue;
+
+		hrtimer_cancel(&per_cpu(emulate_nvm_cpu_stats, cpu).hrtimer);
+		cpumask_clear_cpu(cpu, &ctx->cpus);
+		cpumask_clear_cpu(cpu, &emulate_nvm_cpus);
+		if (mlp_model)
+			core_pmu_disable_stall_counting(cpu);
+		core_pmu_disable_offcore_counting(cpu);
+	}
+
+	emulate_nvm_get_params(ctx, &params);
+	for_each_cpu(cpu, new) {
+		if (cpumask_test_cpu(cpu, &ctx->cpus))
+			continue;
+
+		stat = per_cpu_ptr(&emulate_nvm_cpu_stats, cpu);
+		memset(stat, 0, sizeof(*stat));
+		stat->ctx = ctx;
+		stat->epoch_ns = params.epoch_ns;
+
+		if (mlp_model)
+			core_pmu_enable_stall_counting(cpu);
+		core_pmu_enable_offcore_counting(cpu);
+		cpumask_set_cpu(cpu, &ctx->cpus);
+		cpumask_set_cpu(cpu, &emulate_nvm_cpus);
+		smp_call_function_single(cpu,
+			__emulate_nvm_start_local_hrtimer, NULL, 1);
+	}
+	ctx->cpu = cpumask_first(&ctx->cpus);
+
+out:
+	mutex_unlock(&emulate_nvm_cpus_mutex);
+
+	return ret;
+}
+
+/**
+ * emulate_nvm_set_bandwidth
+ * @ctx:	the context
+ * @mbps:	read bandwidth wanted for NVM node of @ctx
+ * Return:	Non-zero on failure
+ *
+ * If the node is calibrated, it gets the raw threshold measured closest to
+ * @mbps, and @ctx the bandwidth measured there. Otherwise the closest of the
+ * 1, 2 and 4 ratios of dram_bw_mbps. Once bandwidth control runs, @mbps is
+ * its new target, and the calibrated threshold only where it starts from.
+ */
+int emulate_nvm_set_bandwidth(struct emulate_nvm_ctx *ctx, unsigned long mbps)
+{
+	unsigned int raw, threshold;
+	int ret;
+
+	raw = uncore_imc_bw_to_raw(ctx->node, mbps);
+	if (bw_control && READ_ONCE(ctx->thrt_pwr)) {
+		if (raw && !uncore_imc_set_raw_threshold(ctx->node, raw))
+			WRITE_ONCE(ctx->thrt_pwr, raw);
+		WRITE_ONCE(ctx->read_bw_mbps, mbps);
+		return 0;
+	}
+
+	if (raw) {
+		ret = uncore_imc_set_raw_threshold(ctx->node, raw);
+		if (ret)
+			return ret;
+		ctx->throttle = 1;
+		ctx->thrt_pwr = raw;
+		WRITE_ONCE(ctx->read_bw_mbps, uncore_imc_raw_to_bw(ctx->node, raw));
+		return 0;
+	}
+
+	threshold = uncore_imc_bw_to_threshold(dram_bw_mbps, mbps);
+	ret = uncore_imc_set_threshold(ctx->node, threshold);
+	if (ret)
+		return ret;
+	ctx->throttle = threshold;
+	ctx->thrt_pwr = 0;
+	WRITE_ONCE(ctx->read_bw_mbps, dram_bw_mbps / threshold);
 	return 0;
 }
 
 static void finish_emulate_bandwidth(void)
 {
-	/* disable throttling at all nodes */
-	uncore_imc_disable_throttle_all();
+	struct emulate_nvm_ctx *ctx;
+
+	for_each_emulate_nvm_ctx(ctx)
+		uncore_imc_disable_throttle(ctx->node);
+}
+
+static int start_emulate_bandwidth(void)
+{
+	struct emulate_nvm_ctx *ctx;
+	int ret;
+
+	/* default to full bandwidth, DRAM nodes stay there */
+	uncore_imc_set_threshold_all(1);
+
+	/* each NVM node gets its own */
+	for_each_emulate_nvm_ctx(ctx) {
+		if (ctx->thrt_pwr)
+			ret = uncore_imc_set_raw_threshold(ctx->node, ctx->thrt_pwr);
+		else
+			ret = uncore_imc_set_threshold(ctx->node, ctx->throttle);
+		if (ret) {
+			pr_err("Invalid throttle %u of Node %d",
+				ctx->throttle, ctx->node);
+			return ret;
+		}
+	}
+
+	/* enable throttling at NVM nodes only, DRAM nodes are not touched */
+	for_each_emulate_nvm_ctx(ctx) {
+		ret = uncore_imc_enable_throttle(ctx->node);
+		if (ret) {
+			pr_err("Failed to throttle Node %d", ctx->node);
+			finish_emulate_bandwidth();
+			return ret;
+		}
+	}
+
+	return 0;
 }
 
 void show_emulate_parameter(void)
 {
+	struct emulate_nvm_ctx *ctx;
+	struct emulate_nvm_params p;
+
 	pr_info("------------------------ Emulation Parameters ----------------------");
-	pr_info("Hrtimer Duration: %llu ns (%llu ms)\n", emulate_nvm_hrtimer_duration_ns,
-		emulate_nvm_hrtimer_duration_ns/1000000);
-	pr_info("Polling CPU:  CPU%2d (Node %2d)", polling_cpu, polling_node);
-	pr_info("Emulated CPU: CPU%2d (Node %2d)", emulate_nvm_cpu, emulate_nvm_node);
-	
-	pr_info("Latency Model:");
-	pr_info("\t---------------------");
-	pr_info("\t|_______| Read (ns) |");
-	pr_info("\t| NVM   |    %3llu    |", nvm_read_latency_ns);
-	pr_info("\t| DRAM  |    %3llu    |", dram_read_latency_ns);
-	pr_info("\t| Delta |    %3llu    |", read_latency_delta_ns);
-	pr_info("\t---------------------");
+	if (adaptive_epoch && max_stall_ns)
+		pr_info("Adaptive Epoch: %lu - %lu ns, max stall %lu ns, overhead budget %u/1000",
+			min_epoch_ns, max_epoch_ns, max_stall_ns, overhead_budget);
+	if (emulate_nvm_overflow_sampling())
+		pr_info("Polling CPU:  None (HA overflow every %lu reads)", sample_period);
+	else if (self_hosted || emulate_nvm_per_core())
+		pr_info("Polling CPU:  None (self-hosted)");
+	else
+		pr_info("Polling CPU:  CPU%2d (Node %2d)", polling_cpu, polling_node);
+	pr_info("Attribution:  %s", emulate_nvm_attribution_name());
+	pr_info("Stall Counting: %s", mlp_model ? "on" : "off");
+	pr_info("Closed Loop:  %s", closed_loop ? "on (C-Box TOR)" : "off");
+	pr_info("Queueing Model: %s", queue_model ? "on (IMC CAS)" : "off");
+	pr_info("Write Amplification: %s", write_amp ? "on (ACT.WR of NVM node)" : "off");
+	pr_info("Write Buffer: %s", write_buffer ? "on (IMC ACT)" : "off");
+	pr_info("Row Buffer:   %s", row_buffer ? "on (IMC ACT)" : "off");
+	pr_info("Write Limit:  %s", write_limit ? "on (IMC CAS)" : "off");
+	pr_info("Bandwidth Control: %s", bw_control ? "on (IMC RD_CAS, throttle cycles)" : "off");
+
+	for_each_emulate_nvm_ctx(ctx) {
+		emulate_nvm_get_params(ctx, &p);
+
+		pr_info("NVM Node %2d:", ctx->node);
+		pr_info("\tEmulated CPU: %*pbl (Node %2d)",
+			cpumask_pr_args(&ctx->cpus), ctx->cpu_node);
+		pr_info("\tHrtimer Duration: %llu ns (%llu ms)", p.epoch_ns,
+			p.epoch_ns/1000000);
+		pr_info("\tProfile: %s", emulate_nvm_profile_name(ctx->profile));
+		if (ctx->wcb_bytes)
+			pr_info("\tWrite Buffer: %u B per channel, %llu ns hit",
+				ctx->wcb_bytes, ctx->wcb_hit_ns);
+		if (ctx->row_hit_ns)
+			pr_info("\tRow Buffer Hit: %llu ns", ctx->row_hit_ns);
+		if (ctx->thrt_pwr)
+			pr_info("\tIMC Throttle: THRT_PWR 0x%03x (%lu/%lu MB/s read/write)",
+				ctx->thrt_pwr, ctx->read_bw_mbps, ctx->write_bw_mbps);
+		else
+			pr_info("\tIMC Throttle: 1/%u (%lu/%lu MB/s read/write)",
+				ctx->throttle, ctx->read_bw_mbps, ctx->write_bw_mbps);
+		pr_info("\tLatency Model: %s", p.model->name);
+		pr_info("\t----------------------------------");
+		pr_info("\t|_______| Read (ns) | Write (ns) |");
+		pr_info("\t| NVM   |    %3llu    |    %4llu    |",
+			p.nvm_read_ns, p.nvm_write_ns);
+		pr_info("\t| DRAM  |    %3llu    |    %4llu    |",
+			p.dram_read_ns, p.dram_write_ns);
+		pr_info("\t| Delta |    %3llu    |    %4llu    |",
+			p.read_delta_ns, p.write_delta_ns);
+		pr_info("\t----------------------------------");
+	}
 	pr_info("------------------------ Emulation Parameters ----------------------");
 }
 
+static void emulate_nvm_cpu_down(int cpu)
+{
+	if (cpu_online(cpu) && !cpu_down(cpu))
+		cpumask_set_cpu(cpu, &emulate_nvm_offlined);
+}
+
 static int prepare_platform_configuration(void)
 {
+	struct emulate_nvm_ctx *ctx;
 	int cpu;
 	const struct cpumask *mask;
 	
+	cpumask_clear(&emulate_nvm_offlined);
+
+	/*
+	 * With per-core attribution, every core gets its own counts,
+	 * so everybody stays online. Nothing to prepare.
+	 */
+	if (emulate_nvm_per_core())
+		return 0;
+
 	cpu = smp_processor_id();
-	if (cpu != polling_cpu) {
+	if (!self_hosted && cpu != polling_cpu) {
 		printk(KERN_CONT "ERROR: current CPU:%2d is not polling CPU:%2d... ",
 			cpu, polling_cpu);
 		return -1;
@@ -241,44 +1002,43 @@ static int prepare_platform_configuration(void)
 	 * emulating one must be offlined. We have to do this because
 	 * the 'ha_requests_remote_reads' event can _not_ distinguish
 	 * requests from different cpus. To gain a 'best' emulation model,
-	 * only the emulating cpu can alive!
+	 * only the emulating cpu can alive! One per context.
  	 */
-	mask = cpumask_of_node(emulate_nvm_node);
-	for_each_cpu(cpu, mask) {
-		if (cpu != emulate_nvm_cpu)
-			cpu_down(cpu);
+	for_each_emulate_nvm_ctx(ctx) {
+		mask = cpumask_of_node(ctx->cpu_node);
+		for_each_cpu(cpu, mask) {
+			if (cpu != ctx->cpu)
+				emulate_nvm_cpu_down(cpu);
+		}
 	}
 
 	/*
 	 * Hmm, this could be a little strict. All CPUs of polling node
 	 * except the polling cpu should be offlined, too. It is OK if
 	 * they are still online, however...
+	 *
+	 * Nothing to do in self-hosted mode, there is no polling cpu.
 	 */
+	if (self_hosted)
+		return 0;
+
 	mask = cpumask_of_node(polling_node);
 	for_each_cpu(cpu, mask) {
 		if (cpu != polling_cpu)
-			cpu_down(cpu);
+			emulate_nvm_cpu_down(cpu);
 	}
 
 	return 0;
 }
 
+/* Bring back exactly the cpus we took down, nobody else */
 static void restore_platform_configuration(void)
 {
 	int cpu;
-	const struct cpumask *mask;
 
-	mask = cpumask_of_node(emulate_nvm_node);
-	for_each_cpu_not(cpu, mask) {
-		if (cpu != emulate_nvm_cpu)
-			cpu_up(cpu);
-	}
-	
-	mask = cpumask_of_node(polling_node);
-	for_each_cpu(cpu, mask) {
-		if (cpu != polling_cpu)
-			cpu_up(cpu);
-	}
+	for_each_cpu(cpu, &emulate_nvm_offlined)
+		cpu_up(cpu);
+	cpumask_clear(&emulate_nvm_offlined);
 }
 
 #define pr_fail		printk(KERN_CONT "\033[31m fail \033[0m")
@@ -286,43 +1046,184 @@ static void restore_platform_configuration(void)
 
 #define PR_RESULT()	(ret)? pr_fail: pr_okay
 
-void start_emulate_nvm(void)
+int start_emulate_nvm(void)
 {
-	int ret;
+	struct emulate_nvm_params params;
+	struct emulate_nvm_ctx *ctx;
+	int ret, cpu, i;
+
+	if (parse_attribution()) {
+		pr_err("Invalid attribution: %s", attribution);
+		return -EINVAL;
+	}
+
+	/*
+	 * Memory Latency Model, DRAM read latency is
+	 * replaced by the measured one if calibrating
+	 */
+	params.dram_read_ns  = 100;
+	params.nvm_read_ns   = 300;
 
 	/*
-	 * Memory Latency Model
+	 * NVM writes are much slower than reads,
+	 * and they are counted separately.
 	 */
-	dram_read_latency_ns  = 100;
-	nvm_read_latency_ns   = 300;
-	read_latency_delta_ns = 200;
+	params.dram_write_ns = 100;
+	params.nvm_write_ns  = 1000;
 
 	/*
 	 * Polling CPU is the one always polling uncore pmu
-	 * and sending IPI delay function to emulate_nvm_cpu.
+	 * and sending IPI delay function to emulated cpus.
 	 *
-	 * Emulate NVM CPU is the one used to emulate NVM,
-	 * also the receiver of IPI sent from polling cpu.
+	 * Each context has an NVM node, and cpus of another
+	 * node running with its latency. With per-core
+	 * attribution, all cpus of a context are emulated.
+	 * Otherwise, only the first one, which is also the
+	 * receiver of IPI sent from polling cpu.
+	 *
+	 * In self-hosted mode, the polling cpu is not used.
+	 * All of them come from module parameters or discovery.
 	 */
-	polling_cpu = 6;
-	emulate_nvm_cpu = 0;
-
-	polling_node = cpu_to_node(polling_cpu);
-	emulate_nvm_node = cpu_to_node(emulate_nvm_cpu);
+	if (emulate_nvm_topology_init()) {
+		pr_err("Invalid topology");
+		return -EINVAL;
+	}
 
 	/*
 	 * Hrtimer Forward Duration (ns)
-	 * Default: 100 ms
+	 * Default: 100 ms, it is where the adaptive epoch starts from
+	 */
+	params.epoch_ns = max_epoch_ns;
+	if (min_epoch_ns > max_epoch_ns)
+		min_epoch_ns = max_epoch_ns;
+
+	/* Before any throttle or box is touched */
+	if (emulate_nvm_imc_wanted()) {
+		ret = emulate_nvm_imc_check();
+		if (ret < 0)
+			return ret;
+	}
+
+	/* What turns counts into delay, can be changed at runtime */
+	if (emulate_nvm_model_init())
+		return -EINVAL;
+	params.model = emulate_nvm_default_model;
+
+	if (emulate_nvm_profile_init())
+		return -EINVAL;
+
+	/*
+	 * What each throttle value really gives, before anything asks
+	 * for a bandwidth. Like latency calibration, it needs other cpus.
 	 */
-	emulate_nvm_hrtimer_duration_ns = 1000000 * 100;
+	for_each_emulate_nvm_ctx(ctx) {
+		if (emulate_nvm_calibrate_bandwidth(ctx))
+			pr_warn("Calibrating bandwidth of Node %d failed, keep throttle ratios",
+				ctx->node);
+	}
+
+	for (i = 0; i < nr_emulate_nvm_ctxs; i++) {
+		struct emulate_nvm_params p = params;
+		const struct emulate_nvm_profile *profile;
+
+		ctx = &emulate_nvm_ctxs[i];
+		seqlock_init(&ctx->lock);
+		ctx->throttle = 1;
+		ctx->thrt_pwr = 0;
+		ctx->granularity = 64;
+		ctx->wcb_bytes = 0;
+		ctx->wcb_hit_ns = 0;
+		ctx->row_hit_ns = 0;
+		ctx->queue_curve = NULL;
+		ctx->profile = NULL;
+
+		if (i < nr_profiles && *profiles[i]) {
+			profile = emulate_nvm_find_profile(profiles[i]);
+			if (!profile || emulate_nvm_set_profile(ctx, profile)) {
+				pr_err("Invalid profile %s of NVM Node %d",
+					profiles[i], ctx->node);
+				ret = -EINVAL;
+				goto out_throttle;
+			}
+			emulate_nvm_profile_params(profile, &p);
+		}
+
+		if (i < nr_nvm_read_ns && nvm_read_ns[i])
+			p.nvm_read_ns = nvm_read_ns[i];
+		if (i < nr_nvm_write_ns && nvm_write_ns[i])
+			p.nvm_write_ns = nvm_write_ns[i];
+		if (i < nr_throttle && throttle[i]) {
+			if (throttle[i] != 1 && throttle[i] != 2 && throttle[i] != 4) {
+				pr_err("Invalid throttle %u of NVM Node %d",
+					throttle[i], ctx->node);
+				ret = -EINVAL;
+				goto out_throttle;
+			}
+			ctx->throttle = throttle[i];
+			ctx->thrt_pwr = 0;
+
+			/* The ratio wins over a profile, so do its caps */
+			if (ctx->profile && ctx->read_bw_mbps)
+				ctx->write_bw_mbps = ctx->write_bw_mbps *
+					(dram_bw_mbps / ctx->throttle) / ctx->read_bw_mbps;
+			ctx->read_bw_mbps = dram_bw_mbps / ctx->throttle;
+		}
+		if (!ctx->profile)
+			ctx->read_bw_mbps = dram_bw_mbps / ctx->throttle;
+		if (i < nr_nvm_bw_mbps && nvm_bw_mbps[i] &&
+		    emulate_nvm_set_bandwidth(ctx, nvm_bw_mbps[i])) {
+			pr_err("Invalid bandwidth %lu MB/s of NVM Node %d",
+				nvm_bw_mbps[i], ctx->node);
+			ret = -EINVAL;
+			goto out_throttle;
+		}
+		if (!ctx->profile)
+			ctx->write_bw_mbps = ctx->read_bw_mbps;
+		if (i < nr_nvm_write_bw_mbps && nvm_write_bw_mbps[i])
+			ctx->write_bw_mbps = nvm_write_bw_mbps[i];
+
+		if (emulate_nvm_set_params(ctx, &p)) {
+			pr_err("Invalid latency of NVM Node %d", ctx->node);
+			ret = -EINVAL;
+			goto out_throttle;
+		}
+	}
+
+	emulate_nvm_delay_reset();
+	emulate_nvm_delay_calibrate();
+
+	/*
+	 * Real DRAM latency of this machine, instead of 100ns.
+	 * Before offlining anything, the loaders need other cpus.
+	 */
+	if (calibrate) {
+		for_each_emulate_nvm_ctx(ctx) {
+			if (emulate_nvm_calibrate(ctx))
+				pr_warn("Calibrating Node %d failed, keep default DRAM latency",
+					ctx->node);
+		}
+	}
 
 	show_emulate_parameter();
 
+	for_each_possible_cpu(cpu) {
+		struct emulate_nvm_cpu_stat *stat;
+
+		stat = per_cpu_ptr(&emulate_nvm_cpu_stats, cpu);
+		memset(stat, 0, sizeof(*stat));
+		stat->epoch_ns = params.epoch_ns;
+	}
+
+	for_each_emulate_nvm_ctx(ctx) {
+		for_each_cpu(cpu, &ctx->cpus)
+			per_cpu(emulate_nvm_cpu_stats, cpu).ctx = ctx;
+	}
+
 	pr_info("creating /proc/emulate_nvm... ");
 	ret = emulate_nvm_proc_create();
 	PR_RESULT();
 	if (ret)
-		return;
+		goto out_throttle;
 
 	pr_info("preparing platform... ");
 	ret = prepare_platform_configuration();
@@ -343,7 +1244,7 @@ void start_emulate_nvm(void)
 		goto out2;
 
 	emulation_started = true;
-	return;
+	return 0;
 
 out2:
 	finish_emulate_bandwidth();
@@ -351,6 +1252,11 @@ out1:
 	restore_platform_configuration();
 out:
 	emulate_nvm_proc_remove();
+out_throttle:
+	/* Profiles and nvm_bw_mbps have written them already */
+	for_each_emulate_nvm_ctx(ctx)
+		uncore_imc_set_threshold(ctx->node, 1);
+	return ret;
 }
 
 void finish_emulate_nvm(void)
@@ -16,8 +16,356 @@
  *	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
-void start_emulate_nvm(void);
+#include <linux/types.h>
+#include <linux/percpu.h>
+#include <linux/cpumask.h>
+#include <linux/hrtimer.h>
+#include <linux/seqlock.h>
+#include <linux/mutex.h>
+
+struct uncore_box;
+struct emulate_nvm_ctx;
+struct nvm_latency_model_ops;
+struct emulate_nvm_profile;
+struct emulate_nvm_curve;
+
+/* At most one context per socket */
+#define EMULATE_NVM_MAX_CTX	8
+
+int start_emulate_nvm(void);
 void finish_emulate_nvm(void);
 
 int emulate_nvm_proc_create(void);
 void emulate_nvm_proc_remove(void);
+
+/**
+ * struct emulate_nvm_params
+ * @dram_read_ns:	DRAM read latency
+ * @nvm_read_ns:	NVM read latency
+ * @read_delta_ns:	Extra latency of each NVM read
+ * @dram_write_ns:	DRAM write latency
+ * @nvm_write_ns:	NVM write latency
+ * @write_delta_ns:	Extra latency of each NVM write
+ * @epoch_ns:		Epoch length, the longest one if epoch is adaptive
+ * @model:		Latency model turning counts into delay
+ *
+ * Everything that can be changed at runtime through /proc/emulate_nvm.
+ */
+struct emulate_nvm_params {
+	u64	dram_read_ns;
+	u64	nvm_read_ns;
+	u64	read_delta_ns;
+	u64	dram_write_ns;
+	u64	nvm_write_ns;
+	u64	write_delta_ns;
+	u64	epoch_ns;
+	const struct nvm_latency_model_ops *model;
+};
+
+/**
+ * struct emulate_nvm_ctx
+ * @node:	NVM node emulated by this context
+ * @cpu_node:	Node of @cpus
+ * @cpu:	First of @cpus, the only one HA attribution can serve
+ * @cpus:	Cpus running with the latency of this context
+ * @ha_box:	HA box of @node, counts remote requests into it. Its hrtimer
+ *		is the polling timer of this context when not self-hosted
+ * @throttle:	IMC bandwidth throttle ratio of @node
+ * @thrt_pwr:	Raw IMC throttle of @node from its calibration or bandwidth
+ *		control, 0 if @throttle
+ * @read_bw_mbps:	Emulated read bandwidth of @node
+ * @write_bw_mbps:	Emulated write bandwidth of @node
+ * @granularity:	Media access granularity of @node in bytes
+ * @queue_curve:	Queueing delay curve, NULL for queue_curve
+ * @profile:	Device profile of @node, NULL if configured by hand
+ * @params:	Latency profile and epoch, see emulate_nvm_get_params()
+ * @lock:	Protects @params
+ * @measured_read_ns:	Loaded remote read latency from C-Box TOR, 0 if not
+ *			measured (yet), see emulate_nvm_tor.c
+ * @idle_read_ns:	The same at start, the baseline @measured_read_ns drifts from
+ * @bw_mbps:	IMC bandwidth of @node in last epoch, see emulate_nvm_imc.c
+ * @queue_ns:	Queueing delay added to each request at that bandwidth
+ * @wa_pct:	Media write amplification in last epoch, in percent
+ * @wa_write_ns:	Extra media time of each write at that amplification
+ * @wcb_bytes:	Write-combining buffer of each channel of @node, 0 if none
+ * @wcb_hit_ns:	Write latency of a write absorbed by that buffer
+ * @wcb_hit_pct:	Writes absorbed by that buffer in last epoch, in percent
+ * @row_hit_ns:	Read latency of @node on a row buffer hit, 0 if no such thing
+ * @row_hit_pct:	Reads hitting an open row in last epoch, in percent
+ * @wr_limit_ns:	Extra wait of each write to keep within @write_bw_mbps
+ *
+ * One NVM node being emulated. A 4-socket machine could emulate two NVM
+ * nodes with different characteristics at the same time, each for the cpus
+ * of another node.
+ */
+struct emulate_nvm_ctx {
+	int				node;
+	int				cpu_node;
+	unsigned int			cpu;
+	struct cpumask			cpus;
+	struct uncore_box		*ha_box;
+	unsigned int			throttle;
+	unsigned int			thrt_pwr;
+	unsigned long			read_bw_mbps;
+	unsigned long			write_bw_mbps;
+	unsigned int			granularity;
+	const struct emulate_nvm_curve	*queue_curve;
+	const struct emulate_nvm_profile *profile;
+	struct emulate_nvm_params	params;
+	seqlock_t			lock;
+	u64				measured_read_ns;
+	u64				idle_read_ns;
+	u64				bw_mbps;
+	u64				queue_ns;
+	unsigned int			wa_pct;
+	u64				wa_write_ns;
+	unsigned int			wcb_bytes;
+	u64				wcb_hit_ns;
+	unsigned int			wcb_hit_pct;
+	u64				row_hit_ns;
+	unsigned int			row_hit_pct;
+	u64				wr_limit_ns;
+};
+
+extern struct emulate_nvm_ctx emulate_nvm_ctxs[EMULATE_NVM_MAX_CTX];
+extern unsigned int nr_emulate_nvm_ctxs;
+
+#define for_each_emulate_nvm_ctx(ctx)					\
+	for ((ctx) = emulate_nvm_ctxs;					\
+	     (ctx) < emulate_nvm_ctxs + nr_emulate_nvm_ctxs; (ctx)++)
+
+struct emulate_nvm_ctx *emulate_nvm_find_ctx(int node);
+void emulate_nvm_get_params(struct emulate_nvm_ctx *ctx,
+			    struct emulate_nvm_params *params);
+bool emulate_nvm_params_valid(const struct emulate_nvm_params *params);
+int emulate_nvm_set_params(struct emulate_nvm_ctx *ctx,
+			   struct emulate_nvm_params *params);
+int emulate_nvm_set_cpus(struct emulate_nvm_ctx *ctx, const struct cpumask *new);
+
+/* Topology, see emulate_nvm_topology.c */
+extern bool self_hosted;
+extern unsigned int polling_cpu;
+extern unsigned int polling_node;
+int emulate_nvm_topology_init(void);
+
+/* HA box counters used by the latency model */
+enum {
+	HA_READ_CTR	= 0,
+	HA_WRITE_CTR	= 1,
+};
+
+/* How remote requests are attributed to emulated cpus */
+enum {
+	EMULATE_NVM_ATTR_HA	= 0,
+	EMULATE_NVM_ATTR_OFFCORE,
+	EMULATE_NVM_ATTR_CBOX,
+};
+
+extern int attribution_mode;
+const char *emulate_nvm_attribution_name(void);
+
+/* Every emulated cpu gets its own counts and its own delay */
+static inline bool emulate_nvm_per_core(void)
+{
+	return attribution_mode != EMULATE_NVM_ATTR_HA;
+}
+
+/**
+ * struct nvm_latency_counts
+ * @reads:	Remote reads of this epoch
+ * @writes:	Remote writes of this epoch
+ * @stall_ns:	Memory stall time of this epoch, 0 if not counted
+ * @epoch_ns:	How long this epoch really was
+ */
+struct nvm_latency_counts {
+	u64	reads;
+	u64	writes;
+	u64	stall_ns;
+	u64	epoch_ns;
+};
+
+#define NVM_MODEL_NEEDS_STALL	(1 << 0)	/* mlp_model */
+#define NVM_MODEL_NEEDS_IMC	(1 << 1)	/* queue_model */
+
+/**
+ * struct nvm_latency_model_ops
+ * @name:	Name in latency_model and /proc/emulate_nvm
+ * @needs:	Counters it can not do without, NVM_MODEL_NEEDS_*
+ * @delay_ns:	Delay to inject for @counts, on the emulated cpu, irqs off
+ *
+ * A latency model, see emulate_nvm_model.c.
+ */
+struct nvm_latency_model_ops {
+	const char	*name;
+	unsigned int	needs;
+	u64		(*delay_ns)(struct emulate_nvm_ctx *ctx,
+				    const struct emulate_nvm_params *p,
+				    const struct nvm_latency_counts *counts);
+};
+
+extern bool mlp_model;
+extern const struct nvm_latency_model_ops *emulate_nvm_default_model;
+int emulate_nvm_model_init(void);
+const struct nvm_latency_model_ops *emulate_nvm_find_model(const char *name);
+bool emulate_nvm_model_usable(const struct nvm_latency_model_ops *model);
+
+/* Piecewise linear curve of "x:y,x:y,..." module parameters */
+#define EMULATE_NVM_CURVE_POINTS	16
+
+struct emulate_nvm_curve {
+	unsigned int	nr;
+	u64		x[EMULATE_NVM_CURVE_POINTS];
+	u64		y[EMULATE_NVM_CURVE_POINTS];
+};
+
+int emulate_nvm_curve_parse(struct emulate_nvm_curve *curve, const char *str);
+u64 emulate_nvm_curve_lookup(const struct emulate_nvm_curve *curve, u64 x);
+
+/* Device profiles, see emulate_nvm_profile.c */
+extern unsigned long dram_bw_mbps;
+int emulate_nvm_profile_init(void);
+const struct emulate_nvm_profile *emulate_nvm_find_profile(const char *name);
+const char *emulate_nvm_profile_name(const struct emulate_nvm_profile *profile);
+void emulate_nvm_profile_params(const struct emulate_nvm_profile *profile,
+				struct emulate_nvm_params *params);
+int emulate_nvm_set_profile(struct emulate_nvm_ctx *ctx,
+			    const struct emulate_nvm_profile *profile);
+int emulate_nvm_set_bandwidth(struct emulate_nvm_ctx *ctx, unsigned long mbps);
+
+/* DRAM latency calibration, see emulate_nvm_calibrate.c */
+extern bool calibrate;
+extern bool bw_calibrate;
+int emulate_nvm_calibrate(struct emulate_nvm_ctx *ctx);
+int emulate_nvm_calibrate_bandwidth(struct emulate_nvm_ctx *ctx);
+
+/* Closed-loop latency correction, see emulate_nvm_tor.c */
+extern bool closed_loop;
+int emulate_nvm_tor_init(void);
+void emulate_nvm_tor_exit(void);
+void emulate_nvm_tor_correct(struct emulate_nvm_ctx *ctx,
+			     struct emulate_nvm_params *params);
+
+/* Loaded-latency model, see emulate_nvm_queue.c */
+extern bool queue_model;
+int emulate_nvm_queue_init(void);
+void emulate_nvm_queue_epoch(struct emulate_nvm_ctx *ctx, u64 rd_mbps,
+			     u64 media_mbps);
+
+/* Media granularity write amplification, see emulate_nvm_granularity.c */
+extern bool write_amp;
+unsigned int emulate_nvm_wa_epoch(struct emulate_nvm_ctx *ctx, u64 wr, u64 act_wr);
+
+/* On-DIMM write-combining buffer, see emulate_nvm_wcb.c */
+extern bool write_buffer;
+void emulate_nvm_wcb_epoch(struct emulate_nvm_ctx *ctx, u64 wr, u64 act_wr,
+			   unsigned int channels, u64 ns);
+void emulate_nvm_wcb_correct(struct emulate_nvm_ctx *ctx,
+			     struct emulate_nvm_params *params);
+
+/* Row-buffer-aware read penalty, see emulate_nvm_rowbuf.c */
+extern bool row_buffer;
+void emulate_nvm_rowbuf_epoch(struct emulate_nvm_ctx *ctx, u64 rd, u64 act_rd);
+void emulate_nvm_rowbuf_correct(struct emulate_nvm_ctx *ctx,
+				struct emulate_nvm_params *params);
+
+/* Write bandwidth limiter, see emulate_nvm_wrlimit.c */
+extern bool write_limit;
+void emulate_nvm_wrlimit_epoch(struct emulate_nvm_ctx *ctx, u64 wr,
+			       u64 wr_mbps, u64 ns);
+
+/* Closed-loop bandwidth control, see emulate_nvm_bwctl.c */
+extern bool bw_control;
+int emulate_nvm_bwctl_init(void);
+void emulate_nvm_bwctl_epoch(struct emulate_nvm_ctx *ctx, u64 rd_mbps,
+			     u64 thrt, u64 dclk);
+
+/* IMC counting of NVM nodes, see emulate_nvm_imc.c */
+int emulate_nvm_imc_check(void);
+int emulate_nvm_imc_init(void);
+void emulate_nvm_imc_exit(void);
+void emulate_nvm_imc_update(struct emulate_nvm_ctx *ctx);
+
+/* Does anybody want the IMC counts? */
+static inline bool emulate_nvm_imc_wanted(void)
+{
+	return queue_model || write_amp || write_buffer || row_buffer ||
+	       write_limit || bw_control;
+}
+
+/* HA overflow sampling, see emulate_nvm_pmi.c */
+extern unsigned long sample_period;
+int emulate_nvm_pmi_start(void);
+void emulate_nvm_pmi_stop(void);
+void emulate_nvm_inject(u64 reads, u64 writes);
+
+/* Delay is injected on HA overflow, not on an epoch timer */
+static inline bool emulate_nvm_overflow_sampling(void)
+{
+	return sample_period && !emulate_nvm_per_core();
+}
+
+/**
+ * struct emulate_nvm_delay_state
+ * @carry_ns:		Leftover of last delay, added to the next one
+ * @requested_ns:	Total delay asked for on this cpu
+ * @achieved_ns:	Total delay actually wasted on this cpu
+ * @dropped_ns:		Total delay given up because the carry was full
+ */
+struct emulate_nvm_delay_state {
+	s64	carry_ns;
+	u64	requested_ns;
+	u64	achieved_ns;
+	u64	dropped_ns;
+};
+
+/* Longest epoch, also the most delay a cpu may carry */
+extern unsigned long max_epoch_ns;
+
+DECLARE_PER_CPU(struct emulate_nvm_delay_state, emulate_nvm_delay_states);
+
+void emulate_nvm_delay_calibrate(void);
+void emulate_nvm_delay_reset(void);
+u64 emulate_nvm_delay(u64 delay_ns, u64 max_ns);
+u64 emulate_nvm_cycles_to_ns(u64 cycles);
+
+/**
+ * struct emulate_nvm_cpu_stat
+ * @hrtimer:		Pinned epoch timer of this cpu (self-hosted/offcore)
+ * @ctx:		Emulation context this cpu belongs to
+ * @reads:		Remote reads counted in last epoch
+ * @writes:		Remote writes counted in last epoch
+ * @stall_ns:		Memory stall time of last epoch
+ * @delay_ns:		Delay injected in last epoch
+ * @epochs:		Number of epochs ran on this cpu
+ * @epoch_ns:		Length of next epoch, picked by the epoch controller
+ * @overhead_cycles:	Total TSC cycles spent in the machinery itself
+ * @last_ns:		When the last epoch ended, for the real epoch length
+ *
+ * Each emulated cpu only writes its own entry, so no locking is needed.
+ */
+struct emulate_nvm_cpu_stat {
+	struct hrtimer	hrtimer;
+	struct emulate_nvm_ctx *ctx;
+	u64		reads;
+	u64		writes;
+	u64		stall_ns;
+	u64		delay_ns;
+	u64		epochs;
+	u64		epoch_ns;
+	u64		overhead_cycles;
+	u64		last_ns;
+};
+
+DECLARE_PER_CPU(struct emulate_nvm_cpu_stat, emulate_nvm_cpu_stats);
+
+/* All emulated cpus of all contexts, and the mutex that guards changes */
+extern struct cpumask emulate_nvm_cpus;
+extern struct mutex emulate_nvm_cpus_mutex;
+
+/* C-Box TOR attribution, see emulate_nvm_cbox.c */
+extern int emulate_nvm_cbox_leader;
+int emulate_nvm_cbox_init(const struct cpumask *cpus);
+void emulate_nvm_cbox_exit(void);
+unsigned int emulate_nvm_cbox_collect(struct uncore_box **boxes, unsigned int max);
+void emulate_nvm_cbox_epoch(void);
+u64 emulate_nvm_cbox_fetch_reads(void);
@@ -0,0 +1,143 @@
+/*
+ *	Copyright (C) 2015-2016 Yizhou Shan <shanyizhou@ict.ac.cn>
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; either version 2 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License along
+ *	with this program; if not, write to the Free Software Foundation, Inc.,
+ *	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Closed-loop bandwidth control. A THRT_PWR value, even a calibrated one,
+ * gives different bandwidth for different access patterns (reads vs writes,
+ * row hits, which DIMMs are populated). Instead of trusting it, the RD_CAS
+ * bandwidth of every channel of NVM node is compared with read_bw_mbps each
+ * epoch, and THRT_PWR of the node is nudged towards it:
+ *
+ *   raw = raw * target / achieved
+ *
+ * at most 1/8 of raw per epoch, and not within 2% of target.
+ *
+ * Only reads are compared, read_bw_mbps is a read bandwidth. THRT_PWR caps
+ * reads and writes of a channel together, so with writes around it takes a
+ * looser throttle to get the reads there, and writes get through faster too.
+ * Those are left to write_limit.
+ *
+ * Reads below target only loosen the throttle if it is binding, i.e. the IMC
+ * spent at least 1% of its DCLK cycles throttled (POWER_THROTTLE_CYCLES). A
+ * workload that is just not asking for bandwidth would otherwise wind the
+ * throttle all the way open, and the next burst would run at full DRAM speed.
+ *
+ * It starts from the THRT_PWR the node has: the calibrated one, else the one
+ * for read_bw_mbps in the calibration table, else the one of the throttle
+ * ratio. From then on the ratio is 1, the controller owns the register.
+ * Writes to /proc/uncore_pmu for the same node are undone in one epoch.
+ */
+
+#define pr_fmt(fmt) "EMULATE NVM: " fmt
+
+#include "uncore_pmu.h"
+#include "emulate_nvm.h"
+
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+
+bool bw_control = false;
+module_param(bw_control, bool, 0444);
+MODULE_PARM_DESC(bw_control, "Adjust IMC throttle of NVM node every epoch until its reads get read_bw_mbps (default: false)");
+
+/* Close enough, in percent of target */
+#define BWCTL_DEADBAND_PCT		2
+
+/* Largest step, in 1/8 of the current value */
+#define BWCTL_MAX_STEP_SHIFT		3
+
+/* Throttled cycles that make the throttle binding, in percent of DCLK */
+#define BWCTL_BINDING_PCT		1
+
+/**
+ * emulate_nvm_bwctl_epoch
+ * @ctx:	the context, on its first emulated cpu
+ * @rd_mbps:	read bandwidth of NVM node in this epoch
+ * @thrt:	throttled DCLK cycles of NVM node in this epoch
+ * @dclk:	DCLK cycles of NVM node in this epoch
+ */
+void emulate_nvm_bwctl_epoch(struct emulate_nvm_ctx *ctx, u64 rd_mbps,
+			     u64 thrt, u64 dclk)
+{
+	unsigned long target = READ_ONCE(ctx->read_bw_mbps);
+	unsigned int raw, max_raw, step;
+	u64 want;
+
+	raw = READ_ONCE(ctx->thrt_pwr);
+	if (!raw || !target || !rd_mbps)
+		return;
+
+	/* Within the deadband */
+	if (rd_mbps * 100 >= target * (100 - BWCTL_DEADBAND_PCT) &&
+	    rd_mbps * 100 <= target * (100 + BWCTL_DEADBAND_PCT))
+		return;
+
+	/* Below target, but not held back by the throttle */
+	if (rd_mbps < target &&
+	    (!thrt || thrt * 100 < dclk * BWCTL_BINDING_PCT))
+		return;
+
+	want = div64_u64((u64)raw * target, rd_mbps);
+	step = max(raw >> BWCTL_MAX_STEP_SHIFT, 1U);
+	max_raw = uncore_imc_raw_threshold_max();
+
+	if (want > raw)
+		raw = min_t(u64, want, min(raw + step, max_raw));
+	else
+		raw = max_t(u64, want, raw > step ? raw - step : 1);
+
+	if (raw == READ_ONCE(ctx->thrt_pwr))
+		return;
+
+	if (!uncore_imc_set_raw_threshold(ctx->node, raw))
+		WRITE_ONCE(ctx->thrt_pwr, raw);
+}
+
+/**
+ * emulate_nvm_bwctl_init
+ * Return:	Non-zero on failure
+ *
+ * Move every NVM node to a raw threshold, which the controller can nudge.
+ * Call it after bandwidth emulation has started.
+ */
+int emulate_nvm_bwctl_init(void)
+{
+	struct emulate_nvm_ctx *ctx;
+	int ret;
+
+	for_each_emulate_nvm_ctx(ctx) {
+		if (!ctx->thrt_pwr)
+			ctx->thrt_pwr = uncore_imc_bw_to_raw(ctx->node, ctx->read_bw_mbps);
+		if (!ctx->thrt_pwr)
+			ctx->thrt_pwr = uncore_imc_threshold_to_raw(ctx->throttle);
+		if (!ctx->thrt_pwr)
+			ctx->thrt_pwr = uncore_imc_raw_threshold_max();
+
+		ret = uncore_imc_set_raw_threshold(ctx->node, ctx->thrt_pwr);
+		if (ret) {
+			pr_err("Failed to control bandwidth of Node %d", ctx->node);
+			return ret;
+		}
+		ctx->throttle = 1;
+		pr_info("Bandwidth control: Node %d, target %lu MB/s, THRT_PWR 0x%03x",
+			ctx->node, ctx->read_bw_mbps, ctx->thrt_pwr);
+	}
+	return 0;
+}
@@ -0,0 +1,534 @@
+/*
+ *	Copyright (C) 2015-2016 Yizhou Shan <shanyizhou@ict.ac.cn>
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; either version 2 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License along
+ *	with this program; if not, write to the Free Software Foundation, Inc.,
+ *	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * DRAM latency calibration. The latency model only knows the delta between
+ * NVM and DRAM, and DRAM used to be 100ns on every machine. Here we measure it
+ * before emulating: a pointer-chasing kernel runs on the emulated cpu, over a
+ * buffer much bigger than the LLC, once with the buffer on the local node and
+ * once on the NVM node. Cache lines are chained in random order, so neither
+ * the prefetchers nor memory-level parallelism can hide anything, each step is
+ * one full miss.
+ *
+ * The remote chase is repeated with more and more loader threads streaming
+ * over NVM node memory from other cpus of the emulated node, to show how the
+ * latency grows with bandwidth. The idle remote latency becomes dram_read_ns,
+ * so the delta is (target - measured), and the target is what applications
+ * actually see.
+ *
+ * Bandwidth calibration (bw_calibrate=1) is the same idea for the IMC
+ * throttle. What a THRT_PWR value gives depends on the machine, DIMMs and
+ * their population, 1/2 and 1/4 were guesses. Streamers on the cpus of the
+ * emulated node read NVM node memory as fast as they can, while THRT_PWR of
+ * NVM node is swept from 1/128 of its range up to all of it. The bandwidth
+ * measured at each point becomes the table of the node, and bandwidths are
+ * asked for in MB/s from then on. The table is printed as bw_table= so the
+ * next load on the same machine can skip the sweep. Nodes may have different
+ * channels and DIMMs, so bw_table takes one table per nvm_node, separated by
+ * ';' like emulate_cpus. A node with an empty one is swept (or keeps ratios).
+ */
+
+#define pr_fmt(fmt) "EMULATE NVM: " fmt
+
+#include "uncore_pmu.h"
+#include "emulate_nvm.h"
+
+#include <linux/mm.h>
+#include <linux/gfp.h>
+#include <linux/err.h>
+#include <linux/delay.h>
+#include <linux/ktime.h>
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/module.h>
+#include <linux/random.h>
+#include <linux/string.h>
+#include <linux/sched.h>
+#include <linux/kthread.h>
+#include <linux/vmalloc.h>
+#include <linux/cpumask.h>
+#include <linux/workqueue.h>
+
+bool calibrate = true;
+module_param(calibrate, bool, 0444);
+MODULE_PARM_DESC(calibrate, "Measure DRAM latency before emulating, and take dram_read_ns from it (default: true)");
+
+static unsigned int calibrate_mb = 64;
+module_param(calibrate_mb, uint, 0444);
+MODULE_PARM_DESC(calibrate_mb, "Size of the pointer-chasing buffer in MB, well above LLC size (default: 64)");
+
+static unsigned int calibrate_loaders = 4;
+module_param(calibrate_loaders, uint, 0444);
+MODULE_PARM_DESC(calibrate_loaders, "Most loader threads for loaded latency, levels are 0, 1, 2, 4... (default: 4)");
+
+bool bw_calibrate = false;
+module_param(bw_calibrate, bool, 0444);
+MODULE_PARM_DESC(bw_calibrate, "Measure the bandwidth of IMC throttle values on every NVM node before emulating (default: false)");
+
+static unsigned int bw_calibrate_streamers = 8;
+module_param(bw_calibrate_streamers, uint, 0444);
+MODULE_PARM_DESC(bw_calibrate_streamers, "Streaming threads of bandwidth calibration, enough to saturate a node (default: 8)");
+
+static unsigned int bw_calibrate_ms = 100;
+module_param(bw_calibrate_ms, uint, 0444);
+MODULE_PARM_DESC(bw_calibrate_ms, "Measuring time of each throttle value in ms (default: 100)");
+
+static char *bw_table = "";
+module_param(bw_table, charp, 0444);
+MODULE_PARM_DESC(bw_table, "Bandwidth tables from an earlier bw_calibrate, raw:MB/s points, one per nvm_node separated by ';' (default: none, ratios 1, 2 and 4 only)");
+
+/* 4MB chunks, physically contiguous and in the kernel direct map */
+#define CALIBRATE_CHUNK_ORDER		10
+#define CALIBRATE_CHUNK_SIZE		(PAGE_SIZE << CALIBRATE_CHUNK_ORDER)
+#define CALIBRATE_LINE_SIZE		64
+#define CALIBRATE_LINES_PER_CHUNK	(CALIBRATE_CHUNK_SIZE / CALIBRATE_LINE_SIZE)
+#define CALIBRATE_MAX_CHUNKS		256
+
+/* Steps of one chase, about 1 step per line */
+#define CALIBRATE_MIN_STEPS		(1 << 20)
+
+struct calibrate_buf {
+	struct page	*chunks[CALIBRATE_MAX_CHUNKS];
+	unsigned int	nr_chunks;
+	unsigned long	nr_lines;
+	void		*head;
+};
+
+/* Too big for the stack, and calibration runs once at a time anyway */
+static struct calibrate_buf local, remote, load;
+
+static inline void *line_addr(struct calibrate_buf *buf, unsigned long line)
+{
+	return page_address(buf->chunks[line / CALIBRATE_LINES_PER_CHUNK]) +
+		(line % CALIBRATE_LINES_PER_CHUNK) * CALIBRATE_LINE_SIZE;
+}
+
+static void calibrate_free_buf(struct calibrate_buf *buf)
+{
+	while (buf->nr_chunks)
+		__free_pages(buf->chunks[--buf->nr_chunks], CALIBRATE_CHUNK_ORDER);
+	buf->nr_lines = 0;
+	buf->head = NULL;
+}
+
+/*
+ * Allocate on @node only, and chain all lines into one random cycle. If
+ * @chain is false, the buffer is just streamed over by loaders.
+ */
+static int calibrate_alloc_buf(struct calibrate_buf *buf, int node, bool chain)
+{
+	unsigned long i, j, tmp;
+	unsigned int nr;
+	u32 *perm;
+
+	nr = DIV_ROUND_UP((unsigned long)calibrate_mb << 20, CALIBRATE_CHUNK_SIZE);
+	nr = clamp_t(unsigned int, nr, 1, CALIBRATE_MAX_CHUNKS);
+
+	buf->nr_chunks = 0;
+	while (buf->nr_chunks < nr) {
+		buf->chunks[buf->nr_chunks] = alloc_pages_node(node,
+			GFP_KERNEL | __GFP_THISNODE | __GFP_NOWARN,
+			CALIBRATE_CHUNK_ORDER);
+		if (!buf->chunks[buf->nr_chunks]) {
+			calibrate_free_buf(buf);
+			return -ENOMEM;
+		}
+		buf->nr_chunks++;
+	}
+	buf->nr_lines = (unsigned long)nr * CALIBRATE_LINES_PER_CHUNK;
+	buf->head = line_addr(buf, 0);
+
+	if (!chain)
+		return 0;
+
+	perm = vmalloc(buf->nr_lines * sizeof(*perm));
+	if (!perm) {
+		calibrate_free_buf(buf);
+		return -ENOMEM;
+	}
+
+	/* Fisher-Yates */
+	for (i = 0; i < buf->nr_lines; i++)
+		perm[i] = i;
+	for (i = buf->nr_lines - 1; i > 0; i--) {
+		j = prandom_u32_max(i + 1);
+		tmp = perm[i];
+		perm[i] = perm[j];
+		perm[j] = tmp;
+	}
+
+	for (i = 0; i < buf->nr_lines; i++)
+		*(void **)line_addr(buf, perm[i]) =
+			line_addr(buf, perm[(i + 1) % buf->nr_lines]);
+	buf->head = line_addr(buf, perm[0]);
+
+	vfree(perm);
+	return 0;
+}
+
+/* work_on_cpu() callback, runs on the emulated cpu. Returns ns per step. */
+static long calibrate_chase(void *info)
+{
+	struct calibrate_buf *buf = info;
+	unsigned long i, steps;
+	void **p = buf->head;
+	u64 start, end;
+
+	steps = max_t(unsigned long, buf->nr_lines, CALIBRATE_MIN_STEPS);
+
+	/* Warm up TLB, and get the chain out of the LLC */
+	for (i = 0; i < buf->nr_lines; i++)
+		p = READ_ONCE(*p);
+
+	start = ktime_get_ns();
+	for (i = 0; i < steps; i++)
+		p = READ_ONCE(*p);
+	end = ktime_get_ns();
+
+	/* Keep the compiler from dropping the chase */
+	buf->head = p;
+
+	return div64_u64(end - start, steps);
+}
+
+/* Loaders read into here, so the reads are not optimized away */
+static unsigned long calibrate_sink;
+
+/* Loader thread, streams over @data until told to stop */
+static int calibrate_loader(void *data)
+{
+	struct calibrate_buf *buf = data;
+	unsigned long line, sum = 0;
+
+	while (!kthread_should_stop()) {
+		for (line = 0; line < buf->nr_lines; line++) {
+			sum += READ_ONCE(*(unsigned long *)line_addr(buf, line));
+			if (!(line % CALIBRATE_LINES_PER_CHUNK))
+				cond_resched();
+		}
+	}
+
+	calibrate_sink = sum;
+	return 0;
+}
+
+/*
+ * Chase on the NVM node with 0, 1, 2, 4... loaders on other cpus of the
+ * emulated node. Returns the idle latency, or a negative errno.
+ */
+static long calibrate_loaded(struct emulate_nvm_ctx *ctx)
+{
+	struct task_struct *loaders[32];
+	unsigned int nr = 0, level;
+	long idle, ns;
+	int cpu;
+
+	idle = work_on_cpu(ctx->cpu, calibrate_chase, &remote);
+	pr_info("Node %d -> Node %d: %3ld ns (idle)", ctx->cpu_node, ctx->node, idle);
+
+	if (!calibrate_loaders || calibrate_alloc_buf(&load, ctx->node, false))
+		return idle;
+
+	cpu = ctx->cpu;
+	for (level = 1; level <= min_t(unsigned int, calibrate_loaders,
+				       ARRAY_SIZE(loaders)); level *= 2) {
+		while (nr < level) {
+			cpu = cpumask_next(cpu, cpumask_of_node(ctx->cpu_node));
+			if (cpu >= nr_cpu_ids || !cpu_online(cpu))
+				goto out;
+
+			loaders[nr] = kthread_create_on_node(calibrate_loader,
+				&load, ctx->cpu_node, "nvm_calibrate/%d", cpu);
+			if (IS_ERR(loaders[nr]))
+				goto out;
+			kthread_bind(loaders[nr], cpu);
+			wake_up_process(loaders[nr]);
+			nr++;
+		}
+
+		ns = work_on_cpu(ctx->cpu, calibrate_chase, &remote);
+		pr_info("Node %d -> Node %d: %3ld ns (%u loaders)",
+			ctx->cpu_node, ctx->node, ns, nr);
+	}
+
+out:
+	while (nr)
+		kthread_stop(loaders[--nr]);
+	calibrate_free_buf(&load);
+
+	return idle;
+}
+
+/**
+ * emulate_nvm_calibrate
+ * @ctx:	the context to calibrate
+ * Return:	Non-zero on failure, the parameters are left alone then
+ *
+ * Measure local and remote read latency as seen by the emulated cpu of @ctx,
+ * and make dram_read_ns the measured remote one. The target nvm_read_ns is
+ * kept, so the injected delta is target - measured.
+ */
+int emulate_nvm_calibrate(struct emulate_nvm_ctx *ctx)
+{
+	struct emulate_nvm_params params;
+	long local_ns, remote_ns;
+	int ret;
+
+	ret = calibrate_alloc_buf(&local, ctx->cpu_node, true);
+	if (ret)
+		return ret;
+
+	ret = calibrate_alloc_buf(&remote, ctx->node, true);
+	if (ret) {
+		calibrate_free_buf(&local);
+		return ret;
+	}
+
+	local_ns = work_on_cpu(ctx->cpu, calibrate_chase, &local);
+	pr_info("Node %d -> Node %d: %3ld ns (idle, local)",
+		ctx->cpu_node, ctx->cpu_node, local_ns);
+
+	remote_ns = calibrate_loaded(ctx);
+
+	calibrate_free_buf(&local);
+	calibrate_free_buf(&remote);
+
+	if (remote_ns <= 0)
+		return remote_ns ? remote_ns : -EINVAL;
+
+	emulate_nvm_get_params(ctx, &params);
+	params.dram_read_ns = remote_ns;
+	if (params.nvm_read_ns < params.dram_read_ns) {
+		pr_warn("Node %d is already slower (%ld ns) than target %llu ns",
+			ctx->node, remote_ns, params.nvm_read_ns);
+		params.nvm_read_ns = params.dram_read_ns;
+	}
+
+	return emulate_nvm_set_params(ctx, &params);
+}
+
+/*
+ * Bandwidth calibration
+ */
+
+#define CALIBRATE_MAX_STREAMERS		32
+
+/*
+ * Streamers tell their progress every page. Per chunk, a heavily throttled
+ * window sees only a few chunks and the count is off by whole 4MB steps.
+ */
+#define CALIBRATE_LINES_PER_PAGE	(PAGE_SIZE / CALIBRATE_LINE_SIZE)
+
+/* Let a new throttle value settle before measuring */
+#define CALIBRATE_SETTLE_MS		10
+
+struct calibrate_streamer {
+	struct task_struct	*task;
+	struct calibrate_buf	*buf;
+	unsigned long		lines;
+};
+
+static struct calibrate_streamer streamers[CALIBRATE_MAX_STREAMERS];
+
+/* Streamer thread, like a loader, but tells how much it has read */
+static int calibrate_streamer(void *data)
+{
+	struct calibrate_streamer *s = data;
+	struct calibrate_buf *buf = s->buf;
+	unsigned long line, sum = 0;
+
+	while (!kthread_should_stop()) {
+		for (line = 0; line < buf->nr_lines; line++) {
+			sum += READ_ONCE(*(unsigned long *)line_addr(buf, line));
+			if (!((line + 1) % CALIBRATE_LINES_PER_PAGE))
+				WRITE_ONCE(s->lines, s->lines + CALIBRATE_LINES_PER_PAGE);
+			if (!((line + 1) % CALIBRATE_LINES_PER_CHUNK))
+				cond_resched();
+		}
+	}
+
+	calibrate_sink = sum;
+	return 0;
+}
+
+static unsigned long calibrate_streamed_lines(unsigned int nr)
+{
+	unsigned long lines = 0;
+	unsigned int i;
+
+	for (i = 0; i < nr; i++)
+		lines += READ_ONCE(streamers[i].lines);
+	return lines;
+}
+
+/*
+ * 16 raw values, 3/4 and 4/4 of each power of 2 from 1/128 of the range:
+ * 0x17, 0x1f, 0x2f, 0x3f ... 0xbff, 0xfff for a 12-bit THRT_PWR.
+ */
+static unsigned int calibrate_raw_point(unsigned int i)
+{
+	unsigned int base = (uncore_imc_raw_threshold_max() + 1) >> (7 - i / 2);
+
+	return (i & 1 ? base : base / 4 * 3) - 1;
+}
+
+/* Sweep the throttle of NVM node of @ctx with @nr streamers running */
+static void calibrate_sweep(struct emulate_nvm_ctx *ctx, unsigned int nr,
+			    struct uncore_imc_bw_table *table)
+{
+	unsigned long lines, mbps, last = 0;
+	unsigned int i, raw;
+	u64 start;
+
+	table->nr = 0;
+	for (i = 0; i < UNCORE_IMC_BW_POINTS; i++) {
+		raw = calibrate_raw_point(i);
+		if (!raw || uncore_imc_set_raw_threshold(ctx->node, raw))
+			continue;
+		msleep(CALIBRATE_SETTLE_MS);
+
+		lines = calibrate_streamed_lines(nr);
+		start = ktime_get_ns();
+		msleep(bw_calibrate_ms);
+		lines = calibrate_streamed_lines(nr) - lines;
+		mbps = div64_u64((u64)lines * CALIBRATE_LINE_SIZE * 1000,
+				 ktime_get_ns() - start);
+
+		/* Noise should not make the table go backwards */
+		mbps = max(mbps, last);
+		last = mbps;
+
+		table->raw[table->nr] = raw;
+		table->mbps[table->nr] = mbps;
+		table->nr++;
+		pr_info("Node %d THRT_PWR 0x%03x: %6lu MB/s", ctx->node, raw, mbps);
+	}
+}
+
+static void calibrate_print_table(struct emulate_nvm_ctx *ctx,
+				  const struct uncore_imc_bw_table *table)
+{
+	char buf[UNCORE_IMC_BW_POINTS * 16];
+	unsigned int i, len = 0;
+
+	for (i = 0; i < table->nr; i++)
+		len += scnprintf(buf + len, sizeof(buf) - len, "%s%u:%lu",
+				 i ? "," : "", table->raw[i], table->mbps[i]);
+	pr_info("Node %d bw_table=%s", ctx->node, buf);
+}
+
+/*
+ * Table of @ctx in bw_table, the one at its position in nvm_node.
+ * Return: 0 if there is one, 1 if not, negative if it is invalid
+ */
+static int calibrate_given_table(struct emulate_nvm_ctx *ctx,
+				 struct uncore_imc_bw_table *table)
+{
+	struct emulate_nvm_curve curve;
+	int nth = ctx - emulate_nvm_ctxs, ret = 1;
+	char *tables, *p, *str;
+	unsigned int i;
+
+	tables = kstrdup(bw_table, GFP_KERNEL);
+	if (!tables)
+		return -ENOMEM;
+
+	p = tables;
+	str = strsep(&p, ";");
+	while (str && nth--)
+		str = strsep(&p, ";");
+
+	if (str && *str) {
+		ret = emulate_nvm_curve_parse(&curve, str);
+		if (ret) {
+			pr_err("Invalid bw_table of Node %d: %s", ctx->node, str);
+			ret = -EINVAL;
+		} else {
+			table->nr = curve.nr;
+			for (i = 0; i < curve.nr; i++) {
+				table->raw[i] = curve.x[i];
+				table->mbps[i] = curve.y[i];
+			}
+		}
+	}
+
+	kfree(tables);
+	return ret;
+}
+
+/**
+ * emulate_nvm_calibrate_bandwidth
+ * @ctx:	the context whose NVM node is calibrated
+ * Return:	Non-zero on failure, the node keeps ratios 1, 2 and 4 then
+ *
+ * Either take the table of @ctx in bw_table if there is one, or sweep the
+ * throttle of its NVM node. Throttling of the node is off again when it
+ * returns.
+ */
+int emulate_nvm_calibrate_bandwidth(struct emulate_nvm_ctx *ctx)
+{
+	struct uncore_imc_bw_table table;
+	unsigned int nr = 0;
+	int cpu, ret;
+
+	ret = calibrate_given_table(ctx, &table);
+	if (ret <= 0)
+		return ret ? ret : uncore_imc_set_bw_table(ctx->node, &table);
+
+	if (!bw_calibrate)
+		return 0;
+
+	ret = calibrate_alloc_buf(&load, ctx->node, false);
+	if (ret)
+		return ret;
+
+	for_each_cpu(cpu, cpumask_of_node(ctx->cpu_node)) {
+		if (nr == min_t(unsigned int, bw_calibrate_streamers,
+				CALIBRATE_MAX_STREAMERS))
+			break;
+		if (!cpu_online(cpu))
+			continue;
+
+		streamers[nr].buf = &load;
+		streamers[nr].lines = 0;
+		streamers[nr].task = kthread_create_on_node(calibrate_streamer,
+			&streamers[nr], ctx->cpu_node, "nvm_bw_calibrate/%d", cpu);
+		if (IS_ERR(streamers[nr].task))
+			break;
+		kthread_bind(streamers[nr].task, cpu);
+		wake_up_process(streamers[nr].task);
+		nr++;
+	}
+
+	ret = -ENXIO;
+	if (nr && !uncore_imc_enable_throttle(ctx->node)) {
+		calibrate_sweep(ctx, nr, &table);
+		uncore_imc_set_threshold(ctx->node, 1);
+		uncore_imc_disable_throttle(ctx->node);
+		ret = table.nr ? uncore_imc_set_bw_table(ctx->node, &table) : -EIO;
+	}
+
+	while (nr)
+		kthread_stop(streamers[--nr].task);
+	calibrate_free_buf(&load);
+
+	if (!ret)
+		calibrate_print_table(ctx, &table);
+	return ret;
+}
@@ -0,0 +1,265 @@
+/*
+ *	Copyright (C) 2015-2016 Yizhou Shan <shanyizhou@ict.ac.cn>
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; either version 2 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License along
+ *	with this program; if not, write to the Free Software Foundation, Inc.,
+ *	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Per-core remote read attribution with C-Box TOR counters, no core PMU needed.
+ *
+ * Each C-Box has one TID filter, shared by its four counters. So one C-Box can
+ * only watch one thread at a time. We assign C-Boxes to emulated cpus round-
+ * robin, and rotate the assignment every epoch. Physical addresses are hashed
+ * evenly over all LLC slices, so the count a cpu gets from its boxes is scaled
+ * by (all boxes / boxes assigned) to estimate its total remote reads.
+ *
+ * MSRs of C-Box are per-socket, so all of this must run on a cpu of the socket
+ * whose cores we are watching. The leader, which is the first emulated cpu,
+ * reads all boxes at its epoch and publishes counts to every emulated cpu.
+ * Each cpu then picks its own counts up at its own epoch.
+ *
+ * Writebacks carry no TID, so there are no per-core writes in this mode.
+ */
+
+#define pr_fmt(fmt) "EMULATE NVM: " fmt
+
+#include "uncore_pmu.h"
+#include "emulate_nvm.h"
+
+#include <asm/processor.h>
+
+#include <linux/smp.h>
+#include <linux/slab.h>
+#include <linux/types.h>
+#include <linux/atomic.h>
+#include <linux/kernel.h>
+#include <linux/math64.h>
+#include <linux/percpu.h>
+#include <linux/cpumask.h>
+
+extern struct uncore_event cbox_tor_inserts_miss_remote_opcode;
+
+/* Counter 0 is left for TOR_OCCUPANCY, which can only use it */
+#define CBOX_TOR_CTR			2
+
+#define CBOX_MAX_BOXES			32
+
+/* C-Box filter0: TID, filter1: OPC, see uncore_write_filter() */
+#define CBOX_FILTER0_TID(tid)		((u64)(tid) & 0x3F)
+#define CBOX_FILTER1_OPC(opc)		((((u64)(opc) & 0x1FF) << 20) << 32)
+#define CBOX_OPC_DRD			0x182	/* Demand Data Read */
+
+static struct uncore_box *cboxes[CBOX_MAX_BOXES];
+static unsigned int nr_cboxes;
+
+/* Which emulated cpu (index into cbox_cpus) each box is watching */
+static unsigned int cbox_owner[CBOX_MAX_BOXES];
+static unsigned int cbox_rotation;
+
+static int *cbox_cpus;
+static unsigned int nr_cbox_cpus;
+static u64 *cbox_sum;
+static unsigned int *cbox_nr_boxes;
+
+int emulate_nvm_cbox_leader = -1;
+
+/* Published by the leader, consumed by the owner */
+static DEFINE_PER_CPU(atomic64_t, cbox_pending_reads);
+
+/* Last estimate, used when a cpu got no box in this epoch */
+static DEFINE_PER_CPU(u64, cbox_last_reads);
+
+static inline unsigned int cpu_to_tid(int cpu)
+{
+	return cpu_data(cpu).apicid & 0x3F;
+}
+
+/* Assign boxes for next epoch, and let them count again */
+static void cbox_rearm(void)
+{
+	struct uncore_box *box;
+	unsigned int i, owner;
+
+	for (i = 0; i < nr_cboxes; i++) {
+		box = cboxes[i];
+		owner = (i + cbox_rotation) % nr_cbox_cpus;
+		cbox_owner[i] = owner;
+
+		uncore_write_filter(box,
+			CBOX_FILTER0_TID(cpu_to_tid(cbox_cpus[owner])) |
+			CBOX_FILTER1_OPC(CBOX_OPC_DRD));
+		uncore_enable_box(box);
+	}
+	cbox_rotation++;
+}
+
+/**
+ * emulate_nvm_cbox_epoch
+ *
+ * Called by the leader cpu only. Freeze and read every box, turn counts into
+ * per-cpu estimates, publish them, and rotate the assignment.
+ */
+void emulate_nvm_cbox_epoch(void)
+{
+	struct uncore_box *box;
+	unsigned int i, owner;
+	u64 count, estimate;
+
+	for (i = 0; i < nr_cboxes; i++) {
+		box = cboxes[i];
+		/* Frozen, so nothing is counted for the wrong owner */
+		uncore_disable_box(box);
+		count = uncore_read_counter_delta(box, CBOX_TOR_CTR);
+
+		owner = cbox_owner[i];
+		cbox_sum[owner] += count;
+		cbox_nr_boxes[owner]++;
+	}
+
+	for (i = 0; i < nr_cbox_cpus; i++) {
+		if (cbox_nr_boxes[i]) {
+			estimate = div_u64(cbox_sum[i] * nr_cboxes, cbox_nr_boxes[i]);
+			per_cpu(cbox_last_reads, cbox_cpus[i]) = estimate;
+		} else
+			estimate = per_cpu(cbox_last_reads, cbox_cpus[i]);
+
+		atomic64_add(estimate, per_cpu_ptr(&cbox_pending_reads, cbox_cpus[i]));
+		cbox_sum[i] = 0;
+		cbox_nr_boxes[i] = 0;
+	}
+
+	cbox_rearm();
+}
+
+/* Remote reads published to this cpu since last fetch */
+u64 emulate_nvm_cbox_fetch_reads(void)
+{
+	return atomic64_xchg(this_cpu_ptr(&cbox_pending_reads), 0);
+}
+
+static void __emulate_nvm_cbox_setup(void *info)
+{
+	struct uncore_event *event = &cbox_tor_inserts_miss_remote_opcode;
+	unsigned int i;
+
+	for (i = 0; i < nr_cboxes; i++) {
+		uncore_init_box(cboxes[i]);
+		uncore_disable_box(cboxes[i]);
+		uncore_box_bind_event(cboxes[i], event);
+		uncore_enable_event_idx(cboxes[i], CBOX_TOR_CTR, event);
+	}
+	cbox_rearm();
+}
+
+static void __emulate_nvm_cbox_clear(void *info)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr_cboxes; i++) {
+		uncore_disable_box(cboxes[i]);
+		uncore_write_filter(cboxes[i], 0);
+		uncore_clear_box(cboxes[i]);
+	}
+}
+
+/**
+ * emulate_nvm_cbox_collect
+ * @boxes:	where to put them
+ * @max:	size of @boxes
+ * Return:	number of C-Boxes found
+ *
+ * The C-Boxes of a socket, one per core, the rest of box_list does not
+ * exist. MSR boxes are shared by all sockets, use them on a cpu of the socket
+ * you want.
+ */
+unsigned int emulate_nvm_cbox_collect(struct uncore_box **boxes, unsigned int max)
+{
+	struct uncore_box_type *type = uncore_msr_type[UNCORE_MSR_CBOX_ID];
+	unsigned int nr;
+
+	max = min_t(unsigned int, max, type->num_boxes);
+	max = min_t(unsigned int, max, boot_cpu_data.x86_max_cores);
+	for (nr = 0; nr < max; nr++) {
+		boxes[nr] = uncore_get_box(type, nr, 0);
+		if (!boxes[nr])
+			break;
+	}
+	return nr;
+}
+
+/**
+ * emulate_nvm_cbox_init
+ * @cpus:	the emulated cpus, must be in the same socket
+ * Return:	Non-zero on failure
+ *
+ * Collect the C-Boxes, program TOR_INSERTS on them, and pick the leader.
+ */
+int emulate_nvm_cbox_init(const struct cpumask *cpus)
+{
+	unsigned int i;
+	int cpu;
+
+	if (cpumask_empty(cpus))
+		return -EINVAL;
+
+	nr_cboxes = emulate_nvm_cbox_collect(cboxes, CBOX_MAX_BOXES);
+	if (!nr_cboxes) {
+		pr_err("No C-Box found");
+		return -ENXIO;
+	}
+
+	nr_cbox_cpus = cpumask_weight(cpus);
+	cbox_cpus = kcalloc(nr_cbox_cpus, sizeof(*cbox_cpus), GFP_KERNEL);
+	cbox_sum = kcalloc(nr_cbox_cpus, sizeof(*cbox_sum), GFP_KERNEL);
+	cbox_nr_boxes = kcalloc(nr_cbox_cpus, sizeof(*cbox_nr_boxes), GFP_KERNEL);
+	if (!cbox_cpus || !cbox_sum || !cbox_nr_boxes) {
+		emulate_nvm_cbox_exit();
+		return -ENOMEM;
+	}
+
+	i = 0;
+	for_each_cpu(cpu, cpus) {
+		cbox_cpus[i++] = cpu;
+		atomic64_set(per_cpu_ptr(&cbox_pending_reads, cpu), 0);
+		per_cpu(cbox_last_reads, cpu) = 0;
+	}
+
+	cbox_rotation = 0;
+	emulate_nvm_cbox_leader = cbox_cpus[0];
+	smp_call_function_single(emulate_nvm_cbox_leader,
+		__emulate_nvm_cbox_setup, NULL, 1);
+
+	pr_info("C-Box attribution: %u C-Boxes, %u cpus, leader CPU%2d",
+		nr_cboxes, nr_cbox_cpus, emulate_nvm_cbox_leader);
+
+	return 0;
+}
+
+void emulate_nvm_cbox_exit(void)
+{
+	if (emulate_nvm_cbox_leader >= 0) {
+		smp_call_function_single(emulate_nvm_cbox_leader,
+			__emulate_nvm_cbox_clear, NULL, 1);
+		emulate_nvm_cbox_leader = -1;
+	}
+
+	kfree(cbox_cpus);
+	kfree(cbox_sum);
+	kfree(cbox_nr_boxes);
+	cbox_cpus = NULL;
+	cbox_sum = NULL;
+	cbox_nr_boxes = NULL;
+	nr_cbox_cpus = 0;
+}
@@ -0,0 +1,157 @@
+/*
+ *	Copyright (C) 2015-2016 Yizhou Shan <shanyizhou@ict.ac.cn>
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; either version 2 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License along
+ *	with this program; if not, write to the Free Software Foundation, Inc.,
+ *	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * The delay engine. udelay() only knows microseconds, so every epoch used to
+ * lose up to 999ns, and short epochs lost most of their delay. Here we spin on
+ * the TSC directly, after calibrating TSC cycles per nanosecond against the
+ * kernel clock. Whatever the spin could not hit exactly is carried into the
+ * next epoch of the same cpu, so nothing is lost in the long run.
+ */
+
+#define pr_fmt(fmt) "EMULATE NVM: " fmt
+
+#include "core_pmu.h"
+#include "emulate_nvm.h"
+
+#include <linux/delay.h>
+#include <linux/ktime.h>
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/math64.h>
+#include <linux/percpu.h>
+#include <linux/string.h>
+
+/* cycles_per_ns is fixed-point, scaled by 2^EMULATE_NVM_DELAY_SHIFT */
+#define EMULATE_NVM_DELAY_SHIFT		16
+
+/* How long we spin to calibrate */
+#define EMULATE_NVM_DELAY_CALIBRATE_MS	10
+
+static u64 cycles_per_ns;
+
+DEFINE_PER_CPU(struct emulate_nvm_delay_state, emulate_nvm_delay_states);
+
+static inline u64 ns_to_cycles(u64 ns)
+{
+	return (ns * cycles_per_ns) >> EMULATE_NVM_DELAY_SHIFT;
+}
+
+static inline u64 cycles_to_ns(u64 cycles)
+{
+	return div64_u64(cycles << EMULATE_NVM_DELAY_SHIFT, cycles_per_ns);
+}
+
+/*
+ * Core clock cycles (e.g. stall cycles from core PMU) to nanoseconds. This
+ * assumes the core runs at TSC frequency, turn off turbo when emulating.
+ */
+u64 emulate_nvm_cycles_to_ns(u64 cycles)
+{
+	if (unlikely(!cycles_per_ns))
+		return 0;
+	return cycles_to_ns(cycles);
+}
+
+/**
+ * emulate_nvm_delay_calibrate
+ *
+ * Measure how many TSC cycles elapse per nanosecond of the kernel clock.
+ * The TSC is invariant on every cpu we care about, so calibrating once on
+ * any cpu is good enough for all of them.
+ */
+void emulate_nvm_delay_calibrate(void)
+{
+	u64 tsc0, tsc1, ns0, ns1;
+
+	ns0 = ktime_get_ns();
+	tsc0 = core_pmu_rdtsc();
+	mdelay(EMULATE_NVM_DELAY_CALIBRATE_MS);
+	ns1 = ktime_get_ns();
+	tsc1 = core_pmu_rdtsc();
+
+	cycles_per_ns = div64_u64((tsc1 - tsc0) << EMULATE_NVM_DELAY_SHIFT,
+				  ns1 - ns0);
+
+	pr_info("TSC: %llu.%03llu cycles per ns",
+		cycles_per_ns >> EMULATE_NVM_DELAY_SHIFT,
+		((cycles_per_ns & ((1ULL << EMULATE_NVM_DELAY_SHIFT) - 1)) * 1000)
+			>> EMULATE_NVM_DELAY_SHIFT);
+}
+
+/**
+ * emulate_nvm_delay
+ * @delay_ns:	nanoseconds to waste on this cpu
+ * @max_ns:	longest single spin allowed, 0 for no limit
+ * Return:	nanoseconds actually wasted
+ *
+ * Spin on the TSC for @delay_ns plus whatever the previous call on this cpu
+ * left behind. If we overshoot, the next call is shortened by the same amount.
+ * If the spin would be longer than @max_ns, only @max_ns is spent now and the
+ * rest is carried, so one burst never stalls the cpu for too long. The carry
+ * itself is capped at one max_epoch_ns: a cpu asked for more delay than it
+ * can spin, epoch after epoch, would otherwise owe more and more. What goes
+ * over the cap is dropped, and counted in dropped_ns.
+ * Call this with preemption disabled, which is always true in the hrtimer and
+ * IPI handlers.
+ */
+u64 emulate_nvm_delay(u64 delay_ns, u64 max_ns)
+{
+	struct emulate_nvm_delay_state *state;
+	u64 start, cycles, achieved_ns;
+	s64 target_ns;
+
+	if (unlikely(!cycles_per_ns))
+		return 0;
+
+	state = this_cpu_ptr(&emulate_nvm_delay_states);
+	state->requested_ns += delay_ns;
+
+	target_ns = (s64)delay_ns + state->carry_ns;
+	if (target_ns <= 0) {
+		state->carry_ns = target_ns;
+		return 0;
+	}
+
+	if (max_ns && target_ns > max_ns)
+		cycles = ns_to_cycles(max_ns);
+	else
+		cycles = ns_to_cycles(target_ns);
+	start = core_pmu_rdtsc();
+	while (core_pmu_rdtsc() - start < cycles)
+		cpu_relax();
+	achieved_ns = cycles_to_ns(core_pmu_rdtsc() - start);
+
+	state->carry_ns = target_ns - (s64)achieved_ns;
+	if (state->carry_ns > (s64)max_epoch_ns) {
+		state->dropped_ns += state->carry_ns - max_epoch_ns;
+		state->carry_ns = max_epoch_ns;
+	}
+	state->achieved_ns += achieved_ns;
+
+	return achieved_ns;
+}
+
+void emulate_nvm_delay_reset(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(&emulate_nvm_delay_states, cpu), 0,
+		       sizeof(struct emulate_nvm_delay_state));
+}
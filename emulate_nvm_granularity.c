@@ -0,0 +1,82 @@
+/*
+ *	Copyright (C) 2015-2016 Yizhou Shan <shanyizhou@ict.ac.cn>
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; either version 2 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License along
+ *	with this program; if not, write to the Free Software Foundation, Inc.,
+ *	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Media granularity write amplification. Optane-like media write 256B blocks,
+ * a lone 64B write costs a whole block. DRAM does not care, and the emulator
+ * only sees 64B requests. Whether neighbouring lines get merged before they
+ * reach the media depends on write locality, which is taken from the DRAM of
+ * NVM node itself:
+ *
+ *   - A WR_CAS to a row that is open already (no ACT.WR) lands next to a
+ *     recent write. Sequential writers, memset, log appends, all end up
+ *     here, and fill whole blocks.
+ *   - A WR_CAS that needs an ACT.WR opened a row of its own. Scattered small
+ *     writes (e.g. KV stores) do that, they are not merged.
+ *
+ * So with blocks = granularity / 64 and random = ACT.WR / WR_CAS:
+ *
+ *   amplification = random * blocks + (1 - random)
+ *
+ * A DRAM row is much bigger than a media block, so this errs on the side of
+ * too little amplification, never on charging sequential writers.
+ *
+ * The extra media bytes are charged as delay of every write, at the write
+ * bandwidth of the device. The queueing model also sees them as bandwidth.
+ */
+
+#define pr_fmt(fmt) "EMULATE NVM: " fmt
+
+#include "emulate_nvm.h"
+
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+
+bool write_amp = false;
+module_param(write_amp, bool, 0444);
+MODULE_PARM_DESC(write_amp, "Charge media granularity write amplification (default: false)");
+
+/**
+ * emulate_nvm_wa_epoch
+ * @ctx:	the context, on its first emulated cpu
+ * @wr:		WR_CAS of NVM node in this epoch
+ * @act_wr:	ACT.WR of NVM node in this epoch
+ * Return:	write amplification, in percent
+ */
+unsigned int emulate_nvm_wa_epoch(struct emulate_nvm_ctx *ctx, u64 wr, u64 act_wr)
+{
+	unsigned int blocks, wa_pct = 100;
+	unsigned long write_bw_mbps;
+	u64 random_pct;
+
+	blocks = READ_ONCE(ctx->granularity) / 64;
+	if (blocks > 1 && wr) {
+		random_pct = div64_u64(min(act_wr, wr) * 100, wr);
+		wa_pct = 100 + random_pct * (blocks - 1);
+	}
+
+	/* Extra media bytes of one write, at media write bandwidth (B/us) */
+	write_bw_mbps = READ_ONCE(ctx->write_bw_mbps);
+	WRITE_ONCE(ctx->wa_pct, wa_pct);
+	WRITE_ONCE(ctx->wa_write_ns, write_bw_mbps ?
+		div_u64((u64)(wa_pct - 100) * 64 * 1000, 100 * write_bw_mbps) : 0);
+
+	return wa_pct;
+}
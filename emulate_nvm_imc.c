@@ -0,0 +1,294 @@
+/*
+ *	Copyright (C) 2015-2016 Yizhou Shan <shanyizhou@ict.ac.cn>
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; either version 2 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License along
+ *	with this program; if not, write to the Free Software Foundation, Inc.,
+ *	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * IMC counting of NVM nodes. Several parts of the emulator want to know what
+ * the DRAM of an NVM node did in the last epoch: the queueing model, the
+ * write and row buffers, the write limiter, bandwidth control. They all share
+ * the IMC boxes of the node, which are programmed here, with only the events
+ * somebody asked for:
+ *
+ *   CAS_COUNT.RD and CAS_COUNT.WR	always
+ *   ACT_COUNT.WR			write_buffer, write_amp
+ *   ACT_COUNT.RD			row_buffer
+ *   POWER_THROTTLE_CYCLES		bw_control, with the DCLK fixed counter
+ *
+ * Every epoch, the first emulated cpu of a context sums them over all
+ * channels of its NVM node, and hands the counts to whoever is enabled.
+ * Nothing here changes the latency by itself.
+ *
+ * IMC PMON boxes are per-node PCI devices, any cpu can read them.
+ */
+
+#define pr_fmt(fmt) "EMULATE NVM: " fmt
+
+#include "uncore_pmu.h"
+#include "emulate_nvm.h"
+
+#include <linux/smp.h>
+#include <linux/ktime.h>
+#include <linux/types.h>
+#include <linux/errno.h>
+#include <linux/kernel.h>
+#include <linux/math64.h>
+
+extern struct uncore_event imc_cas_count_rd;
+extern struct uncore_event imc_cas_count_wr;
+extern struct uncore_event imc_act_count_wr;
+extern struct uncore_event imc_act_count_rd;
+extern struct uncore_event imc_power_throttle_cycles;
+
+enum imc_event {
+	IMC_CAS_RD,
+	IMC_CAS_WR,
+	IMC_ACT_WR,
+	IMC_ACT_RD,
+	IMC_THROTTLE,
+	NR_IMC_EVENTS
+};
+
+/* General purpose counters of an IMC box */
+#define IMC_MAX_CTRS			4
+
+#define IMC_MAX_BOXES			8
+
+struct emulate_nvm_imc {
+	struct uncore_box	*box[IMC_MAX_BOXES];
+	u64			dclk[IMC_MAX_BOXES];
+	unsigned int		nr_box;
+	u64			ns;
+};
+
+static struct emulate_nvm_imc emulate_nvm_imcs[EMULATE_NVM_MAX_CTX];
+
+/* Counter of each event, -1 if nobody wants it */
+static int imc_ctr[NR_IMC_EVENTS];
+
+static inline struct emulate_nvm_imc *ctx_to_imc(struct emulate_nvm_ctx *ctx)
+{
+	return &emulate_nvm_imcs[ctx - emulate_nvm_ctxs];
+}
+
+static u64 imc_read_event(struct emulate_nvm_imc *imc, enum imc_event event)
+{
+	unsigned int i;
+	u64 sum = 0;
+
+	if (imc_ctr[event] < 0)
+		return 0;
+
+	for (i = 0; i < imc->nr_box; i++)
+		sum += uncore_read_counter_delta(imc->box[i], imc_ctr[event]);
+	return sum;
+}
+
+/* DCLK cycles of all channels since last time */
+static u64 imc_read_dclk(struct emulate_nvm_imc *imc)
+{
+	struct uncore_box *box;
+	unsigned int i;
+	u64 now, sum = 0;
+
+	for (i = 0; i < imc->nr_box; i++) {
+		box = imc->box[i];
+		uncore_read_fixed(box, &now);
+		sum += (now - imc->dclk[i]) & ((1ULL << box->box_type->fixed_ctr_bits) - 1);
+		imc->dclk[i] = now;
+	}
+	return sum;
+}
+
+static void emulate_nvm_imc_epoch(struct emulate_nvm_ctx *ctx)
+{
+	struct emulate_nvm_imc *imc = ctx_to_imc(ctx);
+	u64 rd, wr, act_rd, act_wr, thrt = 0, dclk = 0, now, ns;
+	u64 rd_mbps, wr_mbps, media_mbps;
+
+	rd = imc_read_event(imc, IMC_CAS_RD);
+	wr = imc_read_event(imc, IMC_CAS_WR);
+	act_wr = imc_read_event(imc, IMC_ACT_WR);
+	act_rd = imc_read_event(imc, IMC_ACT_RD);
+	if (bw_control) {
+		thrt = imc_read_event(imc, IMC_THROTTLE);
+		dclk = imc_read_dclk(imc);
+	}
+
+	now = ktime_get_ns();
+	ns = now - imc->ns;
+	imc->ns = now;
+	if (!ns)
+		return;
+
+	if (write_buffer)
+		emulate_nvm_wcb_epoch(ctx, wr, act_wr, imc->nr_box, ns);
+	if (row_buffer)
+		emulate_nvm_rowbuf_epoch(ctx, rd, act_rd);
+
+	/* 64B per CAS, B/ns is GB/s */
+	rd_mbps = div64_u64(rd * 64 * 1000, ns);
+	wr_mbps = div64_u64(wr * 64 * 1000, ns);
+	WRITE_ONCE(ctx->bw_mbps, rd_mbps + wr_mbps);
+
+	/* Small random writes take more of the media than they carry */
+	media_mbps = wr_mbps;
+	if (write_amp)
+		media_mbps = div_u64(wr_mbps * emulate_nvm_wa_epoch(ctx, wr, act_wr), 100);
+
+	if (queue_model)
+		emulate_nvm_queue_epoch(ctx, rd_mbps, media_mbps);
+	/* Amplified bytes are charged by write_amp already, not again */
+	if (write_limit)
+		emulate_nvm_wrlimit_epoch(ctx, wr, wr_mbps, ns);
+	if (bw_control)
+		emulate_nvm_bwctl_epoch(ctx, rd_mbps, thrt, dclk);
+}
+
+/**
+ * emulate_nvm_imc_update
+ * @ctx:	the context of this cpu
+ *
+ * Called by every emulated cpu of @ctx at its epoch boundary, the first one
+ * reads the IMC boxes.
+ */
+void emulate_nvm_imc_update(struct emulate_nvm_ctx *ctx)
+{
+	if (smp_processor_id() == ctx->cpu)
+		emulate_nvm_imc_epoch(ctx);
+}
+
+/* Give a counter to @event if @wanted, Non-zero if there is none left */
+static int imc_assign(enum imc_event event, bool wanted, int *next)
+{
+	imc_ctr[event] = -1;
+	if (!wanted)
+		return 0;
+	if (*next == IMC_MAX_CTRS)
+		return -ENOSPC;
+	imc_ctr[event] = (*next)++;
+	return 0;
+}
+
+/**
+ * emulate_nvm_imc_check
+ * Return:	Number of counters taken, -ENOSPC if the events wanted do not fit
+ *
+ * Give out the counters, nothing is programmed. Call it before anything
+ * else is set up, so a parameter combination that can not work fails early.
+ */
+int emulate_nvm_imc_check(void)
+{
+	int next = 0;
+
+	if (imc_assign(IMC_CAS_RD, true, &next) ||
+	    imc_assign(IMC_CAS_WR, true, &next) ||
+	    imc_assign(IMC_ACT_WR, write_buffer || write_amp, &next) ||
+	    imc_assign(IMC_ACT_RD, row_buffer, &next) ||
+	    imc_assign(IMC_THROTTLE, bw_control, &next)) {
+		pr_err("Too many IMC events, an IMC box has %d counters: "
+		       "pick two of write_buffer/write_amp, row_buffer and bw_control",
+		       IMC_MAX_CTRS);
+		return -ENOSPC;
+	}
+	return next;
+}
+
+/**
+ * emulate_nvm_imc_init
+ * Return:	Non-zero on failure
+ *
+ * Count the events wanted on all IMC channels of every NVM node.
+ */
+int emulate_nvm_imc_init(void)
+{
+	struct uncore_box_type *type = uncore_pci_type[UNCORE_PCI_IMC_ID];
+	static struct uncore_event *events[NR_IMC_EVENTS] = {
+		[IMC_CAS_RD]	= &imc_cas_count_rd,
+		[IMC_CAS_WR]	= &imc_cas_count_wr,
+		[IMC_ACT_WR]	= &imc_act_count_wr,
+		[IMC_ACT_RD]	= &imc_act_count_rd,
+		[IMC_THROTTLE]	= &imc_power_throttle_cycles,
+	};
+	struct emulate_nvm_imc *imc;
+	struct emulate_nvm_ctx *ctx;
+	struct uncore_box *box;
+	int next, event;
+	unsigned int i;
+
+	next = emulate_nvm_imc_check();
+	if (next < 0)
+		return next;
+
+	for_each_emulate_nvm_ctx(ctx) {
+		imc = ctx_to_imc(ctx);
+		imc->nr_box = 0;
+		for (i = 0; i < min_t(unsigned int, type->num_boxes, IMC_MAX_BOXES); i++) {
+			box = uncore_get_box(type, i, ctx->node);
+			if (!box)
+				continue;
+
+			uncore_init_box(box);
+			uncore_disable_box(box);
+			for (event = 0; event < NR_IMC_EVENTS; event++) {
+				if (imc_ctr[event] >= 0)
+					uncore_enable_event_idx(box, imc_ctr[event],
+						events[event]);
+			}
+			if (bw_control) {
+				uncore_enable_fixed(box, true);
+				uncore_read_fixed(box, &imc->dclk[imc->nr_box]);
+			}
+			uncore_enable_box(box);
+			imc->box[imc->nr_box++] = box;
+		}
+
+		if (!imc->nr_box) {
+			pr_err("No IMC Box on NVM Node %d", ctx->node);
+			emulate_nvm_imc_exit();
+			return -ENXIO;
+		}
+
+		ctx->bw_mbps = 0;
+		ctx->queue_ns = 0;
+		ctx->wcb_hit_pct = 0;
+		ctx->row_hit_pct = 0;
+		ctx->wr_limit_ns = 0;
+		ctx->wa_pct = 100;
+		ctx->wa_write_ns = 0;
+		imc->ns = ktime_get_ns();
+		pr_info("IMC counting: Node %d, %u channels, %d events",
+			ctx->node, imc->nr_box, next);
+	}
+
+	return 0;
+}
+
+void emulate_nvm_imc_exit(void)
+{
+	struct emulate_nvm_imc *imc;
+	struct emulate_nvm_ctx *ctx;
+	unsigned int i;
+
+	for_each_emulate_nvm_ctx(ctx) {
+		imc = ctx_to_imc(ctx);
+		for (i = 0; i < imc->nr_box; i++) {
+			uncore_enable_fixed(imc->box[i], false);
+			uncore_clear_box(imc->box[i]);
+		}
+		imc->nr_box = 0;
+	}
+}
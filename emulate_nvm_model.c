@@ -0,0 +1,300 @@
+/*
+ *	Copyright (C) 2015-2016 Yizhou Shan <shanyizhou@ict.ac.cn>
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; either version 2 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License along
+ *	with this program; if not, write to the Free Software Foundation, Inc.,
+ *	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Latency models. Each one turns the counts of an epoch into the delay to
+ * inject on the emulated cpu. They are part of the parameters of a context, so
+ * they can be switched at runtime, and two contexts can run two models side
+ * by side:
+ *
+ *	echo "node=3 model=table" > /proc/emulate_nvm
+ *
+ * A model can only be picked if the counters it needs are running, i.e. the
+ * mlp model needs mlp_model=1 (stall counting), queueing needs queue_model=1
+ * (queueing delay of IMC bandwidth).
+ */
+
+#define pr_fmt(fmt) "EMULATE NVM: " fmt
+
+#include "emulate_nvm.h"
+
+#include <linux/slab.h>
+#include <linux/types.h>
+#include <linux/errno.h>
+#include <linux/kernel.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+#include <linux/string.h>
+
+static char *latency_model = "";
+module_param(latency_model, charp, 0444);
+MODULE_PARM_DESC(latency_model, "Latency model of all contexts: linear, mlp, queueing or table (default: queueing if queue_model, mlp if mlp_model, linear otherwise)");
+
+static char *latency_table = "0:300,5:350,10:450,20:700";
+module_param(latency_table, charp, 0444);
+MODULE_PARM_DESC(latency_table, "NVM read latency of the table model, rate:ns points, rate in reads per us of one cpu (default: 0:300,5:350,10:450,20:700)");
+
+static struct emulate_nvm_curve latency_table_curve;
+
+/**
+ * emulate_nvm_curve_parse
+ * @curve:	where to put it
+ * @str:	"x:y,x:y,..." with x ascending
+ * Return:	Non-zero on invalid @str
+ */
+int emulate_nvm_curve_parse(struct emulate_nvm_curve *curve, const char *str)
+{
+	unsigned long long x, y;
+	char *buf, *p, *point;
+	int ret = 0;
+
+	buf = kstrdup(str, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	curve->nr = 0;
+	p = buf;
+	while ((point = strsep(&p, ",")) != NULL) {
+		if (!*point)
+			continue;
+		if (curve->nr == EMULATE_NVM_CURVE_POINTS ||
+		    sscanf(point, "%llu:%llu", &x, &y) != 2 ||
+		    (curve->nr && x <= curve->x[curve->nr - 1])) {
+			ret = -EINVAL;
+			break;
+		}
+		curve->x[curve->nr] = x;
+		curve->y[curve->nr] = y;
+		curve->nr++;
+	}
+
+	if (!curve->nr)
+		ret = -EINVAL;
+
+	kfree(buf);
+	return ret;
+}
+
+/**
+ * emulate_nvm_curve_lookup
+ * @curve:	a parsed curve
+ * @x:		where to look
+ *
+ * Piecewise linear between the points, flat beyond both ends.
+ */
+u64 emulate_nvm_curve_lookup(const struct emulate_nvm_curve *curve, u64 x)
+{
+	unsigned int i;
+	u64 y0, y1;
+
+	if (x <= curve->x[0])
+		return curve->y[0];
+
+	for (i = 1; i < curve->nr; i++) {
+		if (x > curve->x[i])
+			continue;
+
+		y0 = curve->y[i - 1];
+		y1 = curve->y[i];
+		if (y1 >= y0)
+			return y0 + div64_u64((y1 - y0) * (x - curve->x[i - 1]),
+				curve->x[i] - curve->x[i - 1]);
+		return y0 - div64_u64((y0 - y1) * (x - curve->x[i - 1]),
+			curve->x[i] - curve->x[i - 1]);
+	}
+
+	return curve->y[curve->nr - 1];
+}
+
+/*
+ * Hmm, this depends on the emulating model. Anyone who even knows a little
+ * about computer architecture should know this model sucks. No modern processor
+ * would wait the entire memory read transaction, even read is on the critical
+ * path. Why I still do this? I can not tell you why. Sigh.
+ */
+static u64 linear_delay_ns(struct emulate_nvm_ctx *ctx,
+			   const struct emulate_nvm_params *p,
+			   const struct nvm_latency_counts *counts)
+{
+	return counts->reads * p->read_delta_ns +
+	       counts->writes * p->write_delta_ns;
+}
+
+/*
+ * Well, with mlp_model we do better, the way Quartz does. Overlapped misses
+ * only stall the core once, so the linear delay is scaled by the memory stall
+ * time per miss over the DRAM latency:
+ *
+ *   read_delay = reads * delta * (stall_ns / reads) / dram_latency
+ *              = stall_ns * delta / dram_latency
+ *
+ * Streaming workloads with lots of overlapped misses get much less delay than
+ * before, pointer-chasing ones get about the same. It never charges more than
+ * the linear model. Writes are not on the stall path, they stay linear.
+ */
+static u64 mlp_read_delay_ns(const struct emulate_nvm_params *p,
+			     u64 reads, u64 stall_ns, u64 delta_ns)
+{
+	u64 read_delay_ns = reads * delta_ns;
+
+	if (p->dram_read_ns)
+		read_delay_ns = min(read_delay_ns,
+			div64_u64(stall_ns * delta_ns, p->dram_read_ns));
+	return read_delay_ns;
+}
+
+static u64 mlp_delay_ns(struct emulate_nvm_ctx *ctx,
+			const struct emulate_nvm_params *p,
+			const struct nvm_latency_counts *counts)
+{
+	return mlp_read_delay_ns(p, counts->reads, counts->stall_ns,
+				 p->read_delta_ns) +
+	       counts->writes * p->write_delta_ns;
+}
+
+/*
+ * Every request also waits in the queue of a busy NVM node, see
+ * emulate_nvm_queue.c. Reads are MLP-scaled if stalls are counted.
+ */
+static u64 queueing_delay_ns(struct emulate_nvm_ctx *ctx,
+			     const struct emulate_nvm_params *p,
+			     const struct nvm_latency_counts *counts)
+{
+	u64 queue_ns = READ_ONCE(ctx->queue_ns);
+	u64 read_delay_ns;
+
+	if (mlp_model)
+		read_delay_ns = mlp_read_delay_ns(p, counts->reads,
+			counts->stall_ns, p->read_delta_ns + queue_ns);
+	else
+		read_delay_ns = counts->reads * (p->read_delta_ns + queue_ns);
+
+	return read_delay_ns + counts->writes * (p->write_delta_ns + queue_ns);
+}
+
+/*
+ * NVM read latency looked up in latency_table by the read rate of this cpu,
+ * e.g. taken from a loaded-latency curve of a real device. nvm_read_ns is
+ * not used, writes stay linear.
+ */
+static u64 table_delay_ns(struct emulate_nvm_ctx *ctx,
+			  const struct emulate_nvm_params *p,
+			  const struct nvm_latency_counts *counts)
+{
+	u64 rate, nvm_read_ns, delta_ns = 0;
+
+	rate = counts->epoch_ns ?
+		div64_u64(counts->reads * 1000, counts->epoch_ns) : 0;
+	nvm_read_ns = emulate_nvm_curve_lookup(&latency_table_curve, rate);
+	if (nvm_read_ns > p->dram_read_ns)
+		delta_ns = nvm_read_ns - p->dram_read_ns;
+
+	return counts->reads * delta_ns + counts->writes * p->write_delta_ns;
+}
+
+static const struct nvm_latency_model_ops linear_model = {
+	.name		= "linear",
+	.needs		= 0,
+	.delay_ns	= linear_delay_ns,
+};
+
+static const struct nvm_latency_model_ops mlp_model_ops = {
+	.name		= "mlp",
+	.needs		= NVM_MODEL_NEEDS_STALL,
+	.delay_ns	= mlp_delay_ns,
+};
+
+static const struct nvm_latency_model_ops queueing_model = {
+	.name		= "queueing",
+	.needs		= NVM_MODEL_NEEDS_IMC,
+	.delay_ns	= queueing_delay_ns,
+};
+
+static const struct nvm_latency_model_ops table_model = {
+	.name		= "table",
+	.needs		= 0,
+	.delay_ns	= table_delay_ns,
+};
+
+static const struct nvm_latency_model_ops *emulate_nvm_models[] = {
+	&linear_model,
+	&mlp_model_ops,
+	&queueing_model,
+	&table_model,
+};
+
+const struct nvm_latency_model_ops *emulate_nvm_default_model = &linear_model;
+
+/* The model called @name, or NULL */
+const struct nvm_latency_model_ops *emulate_nvm_find_model(const char *name)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(emulate_nvm_models); i++) {
+		if (!strcmp(name, emulate_nvm_models[i]->name))
+			return emulate_nvm_models[i];
+	}
+	return NULL;
+}
+
+/* Are the counters @model needs running? */
+bool emulate_nvm_model_usable(const struct nvm_latency_model_ops *model)
+{
+	if ((model->needs & NVM_MODEL_NEEDS_STALL) && !mlp_model)
+		return false;
+	if ((model->needs & NVM_MODEL_NEEDS_IMC) && !queue_model)
+		return false;
+	return true;
+}
+
+/**
+ * emulate_nvm_model_init
+ * Return:	Non-zero on failure
+ *
+ * Parse latency_table, and pick the model contexts start with.
+ */
+int emulate_nvm_model_init(void)
+{
+	const struct nvm_latency_model_ops *model;
+
+	if (emulate_nvm_curve_parse(&latency_table_curve, latency_table)) {
+		pr_err("Invalid latency_table: %s", latency_table);
+		return -EINVAL;
+	}
+
+	if (*latency_model) {
+		model = emulate_nvm_find_model(latency_model);
+		if (!model) {
+			pr_err("Unknown latency_model: %s", latency_model);
+			return -EINVAL;
+		}
+	} else if (queue_model)
+		model = &queueing_model;
+	else if (mlp_model)
+		model = &mlp_model_ops;
+	else
+		model = &linear_model;
+
+	if (!emulate_nvm_model_usable(model)) {
+		pr_err("Counters of latency_model %s are off", model->name);
+		return -EINVAL;
+	}
+
+	emulate_nvm_default_model = model;
+	return 0;
+}
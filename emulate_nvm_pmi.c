@@ -0,0 +1,281 @@
+/*
+ *	Copyright (C) 2015-2016 Yizhou Shan <shanyizhou@ict.ac.cn>
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; either version 2 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License along
+ *	with this program; if not, write to the Free Software Foundation, Inc.,
+ *	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Overflow-driven sampling of the HA box, instead of polling it periodically.
+ *
+ * The read counter of the HA box is preloaded with -sample_period. When it
+ * wraps, the box reports the overflow (OV_EN is set in the HA events) to the
+ * U-Box, which raises a PMI on the core selected in the global control MSR of
+ * that socket. Just like core_pmu_nmi_handler(), we catch it as an NMI.
+ *
+ * The PMI can only go to a core of the NVM node, and PCI config space can not
+ * be touched in NMI context (pci_lock). So the chain is:
+ *
+ *   NMI (PMI cpu): ack global status, queue irq_work
+ *   irq_work (PMI cpu): read and re-preload the box, queue async IPI
+ *   IPI (emulated cpu): turn counts into delay and waste it
+ *
+ * The delay is applied within sample_period remote reads, whatever the timer
+ * rate is, and an idle workload costs nothing at all. Writes are read along
+ * with the reads, they do not raise PMIs themselves.
+ */
+
+#define pr_fmt(fmt) "EMULATE NVM: " fmt
+
+#include "uncore_pmu.h"
+#include "emulate_nvm.h"
+
+#include <asm/nmi.h>
+#include <asm/apic.h>
+
+#include <linux/smp.h>
+#include <linux/types.h>
+#include <linux/atomic.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/cpumask.h>
+#include <linux/irq_work.h>
+#include <linux/topology.h>
+
+unsigned long sample_period;
+module_param(sample_period, ulong, 0444);
+MODULE_PARM_DESC(sample_period, "Remote reads between two HA overflow interrupts, 0 to poll with hrtimer instead (default: 0)");
+
+/**
+ * struct emulate_nvm_pmi
+ * @ctx:	the context sampled
+ * @cpu:	cpu of NVM node receiving the PMI of @ctx
+ * @work:	runs the box part on @cpu, out of NMI context
+ * @csd:	sends the counts to the emulated cpu of @ctx
+ * @busy:	@csd is in flight
+ * @reads:	remote reads not injected yet
+ * @writes:	remote writes not injected yet
+ * @overflows:	number of overflows taken
+ */
+struct emulate_nvm_pmi {
+	struct emulate_nvm_ctx	*ctx;
+	int			cpu;
+	struct irq_work		work;
+	struct call_single_data	csd;
+	atomic_t		busy;
+	atomic64_t		reads;
+	atomic64_t		writes;
+	u64			overflows;
+};
+
+static struct emulate_nvm_pmi emulate_nvm_pmis[EMULATE_NVM_MAX_CTX];
+static bool pmi_started = false;
+
+static inline u64 pmi_preload(struct uncore_box *box)
+{
+	return -(u64)sample_period & uncore_box_ctr_mask(box);
+}
+
+/* Only the read counter is preloaded, writes are free-running */
+static void emulate_nvm_pmi_rearm(struct uncore_box *box)
+{
+	uncore_write_counter_idx(box, HA_READ_CTR, pmi_preload(box));
+	uncore_enable_box(box);
+}
+
+/* Runs on the emulated cpu */
+static void emulate_nvm_pmi_inject(void *info)
+{
+	struct emulate_nvm_pmi *pmi = info;
+	u64 reads, writes;
+
+	/* Anything counted after this goes with the next IPI */
+	atomic_set(&pmi->busy, 0);
+	smp_mb__after_atomic();
+
+	reads = atomic64_xchg(&pmi->reads, 0);
+	writes = atomic64_xchg(&pmi->writes, 0);
+	emulate_nvm_inject(reads, writes);
+}
+
+/* Hardirq on the PMI cpu, PCI config space is fine here */
+static void emulate_nvm_pmi_work(struct irq_work *work)
+{
+	struct emulate_nvm_pmi *pmi;
+	struct uncore_box *box;
+	u64 status, reads, writes;
+
+	pmi = container_of(work, struct emulate_nvm_pmi, work);
+	box = pmi->ctx->ha_box;
+
+	uncore_disable_box(box);
+	status = uncore_ack_box(box);
+
+	/* Some other box of this socket overflowed, not our business */
+	if (!(status & (1 << HA_READ_CTR))) {
+		uncore_enable_box(box);
+		goto out;
+	}
+
+	/* A whole period plus whatever came after the wrap, deltas from preload */
+	reads = uncore_read_counter_delta(box, HA_READ_CTR);
+	writes = uncore_read_counter_delta(box, HA_WRITE_CTR);
+	emulate_nvm_pmi_rearm(box);
+
+	atomic64_add(reads, &pmi->reads);
+	atomic64_add(writes, &pmi->writes);
+	pmi->overflows++;
+
+	if (!atomic_xchg(&pmi->busy, 1))
+		smp_call_function_single_async(pmi->ctx->cpu, &pmi->csd);
+
+out:
+	/* The U-Box may have frozen everybody on PMI */
+	uncore_pmu_enable_pmi(&uncore_pmu);
+}
+
+static int emulate_nvm_pmi_nmi_handler(unsigned int type, struct pt_regs *regs)
+{
+	struct emulate_nvm_pmi *pmi;
+	int cpu = smp_processor_id();
+	unsigned int i;
+
+	for (i = 0; i < nr_emulate_nvm_ctxs; i++) {
+		pmi = &emulate_nvm_pmis[i];
+		if (pmi->cpu == cpu)
+			break;
+	}
+	if (i == nr_emulate_nvm_ctxs)
+		return NMI_DONE;
+
+	if (!uncore_pmu_ack_pmi(&uncore_pmu))
+		return NMI_DONE;
+
+	/* LVTPC is masked on delivery */
+	apic_write(APIC_LVTPC, APIC_DM_NMI);
+	irq_work_queue(&pmi->work);
+
+	return NMI_HANDLED;
+}
+
+static void __emulate_nvm_pmi_enable(void *info)
+{
+	int *ret = info;
+
+	apic_write(APIC_LVTPC, APIC_DM_NMI);
+	*ret = uncore_pmu_enable_pmi(&uncore_pmu);
+}
+
+static void __emulate_nvm_pmi_disable(void *info)
+{
+	uncore_pmu_disable_pmi(&uncore_pmu);
+}
+
+static void __emulate_nvm_pmi_nop(void *info)
+{
+}
+
+/* A cpu of NVM node, the polling cpu if it lives there */
+static int emulate_nvm_pmi_cpu(struct emulate_nvm_ctx *ctx)
+{
+	if (polling_cpu < nr_cpu_ids && cpu_online(polling_cpu) &&
+	    cpu_to_node(polling_cpu) == ctx->node)
+		return polling_cpu;
+
+	return cpumask_first_and(cpumask_of_node(ctx->node), cpu_online_mask);
+}
+
+/**
+ * emulate_nvm_pmi_start
+ * Return:	Non-zero on failure
+ *
+ * Preload the HA boxes of all contexts, which must be counting already, and
+ * route their overflow PMIs to a cpu of each NVM node.
+ */
+int emulate_nvm_pmi_start(void)
+{
+	struct emulate_nvm_pmi *pmi;
+	unsigned int i;
+	int ret;
+
+	if (!sample_period)
+		return -EINVAL;
+
+	for (i = 0; i < nr_emulate_nvm_ctxs; i++) {
+		pmi = &emulate_nvm_pmis[i];
+		memset(pmi, 0, sizeof(*pmi));
+		pmi->ctx = &emulate_nvm_ctxs[i];
+		pmi->cpu = emulate_nvm_pmi_cpu(pmi->ctx);
+		if (pmi->cpu >= nr_cpu_ids) {
+			pr_err("No online cpu on NVM Node %d for PMI", pmi->ctx->node);
+			return -ENXIO;
+		}
+
+		init_irq_work(&pmi->work, emulate_nvm_pmi_work);
+		pmi->csd.func = emulate_nvm_pmi_inject;
+		pmi->csd.info = pmi;
+
+		uncore_disable_box(pmi->ctx->ha_box);
+		uncore_ack_box(pmi->ctx->ha_box);
+		emulate_nvm_pmi_rearm(pmi->ctx->ha_box);
+	}
+
+	/* First, just like the core PMU one */
+	ret = register_nmi_handler(NMI_LOCAL, emulate_nvm_pmi_nmi_handler,
+		NMI_FLAG_FIRST, "EMULATE_NVM_PMI");
+	if (ret)
+		return ret;
+	pmi_started = true;
+
+	for (i = 0; i < nr_emulate_nvm_ctxs; i++) {
+		pmi = &emulate_nvm_pmis[i];
+		smp_call_function_single(pmi->cpu, __emulate_nvm_pmi_enable, &ret, 1);
+		if (ret) {
+			pr_err("Can not route PMI of Node %d to CPU%2d",
+				pmi->ctx->node, pmi->cpu);
+			emulate_nvm_pmi_stop();
+			return ret;
+		}
+		pr_info("Overflow sampling: Node %d, every %lu reads, PMI on CPU%2d",
+			pmi->ctx->node, sample_period, pmi->cpu);
+	}
+
+	return 0;
+}
+
+void emulate_nvm_pmi_stop(void)
+{
+	struct emulate_nvm_pmi *pmi;
+	unsigned int i;
+
+	if (!pmi_started)
+		return;
+
+	for (i = 0; i < nr_emulate_nvm_ctxs; i++) {
+		pmi = &emulate_nvm_pmis[i];
+		smp_call_function_single(pmi->cpu, __emulate_nvm_pmi_disable, NULL, 1);
+	}
+	unregister_nmi_handler(NMI_LOCAL, "EMULATE_NVM_PMI");
+
+	/* Flush whatever is still on its way to the emulated cpus */
+	for (i = 0; i < nr_emulate_nvm_ctxs; i++) {
+		pmi = &emulate_nvm_pmis[i];
+		irq_work_sync(&pmi->work);
+		smp_call_function_single(pmi->ctx->cpu, __emulate_nvm_pmi_nop, NULL, 1);
+		pr_info("Overflow sampling: Node %d, %llu overflows",
+			pmi->ctx->node, pmi->overflows);
+	}
+
+	pmi_started = false;
+}
@@ -18,6 +18,7 @@
 
 #include "emulate_nvm.h"
 
+#include <asm/tsc.h>
 #include <asm/uaccess.h>
 
 #include <linux/list.h>
@@ -25,22 +26,90 @@
 #include <linux/errno.h>
 #include <linux/types.h>
 #include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/math64.h>
 #include <linux/module.h>
 #include <linux/proc_fs.h>
 #include <linux/seq_file.h>
+#include <linux/slab.h>
 
-extern u64 read_latency_delta_ns;
-extern u64 hrtimer_jiffies;
-
-u64 proc_counts;
 
 static int emulate_nvm_proc_show(struct seq_file *m, void *v)
 {
-	seq_printf(m, "this moment, counts=%llu, delay_ns=%llu\n",
-			proc_counts, proc_counts*read_latency_delta_ns);
-	
-	seq_printf(m, "total jiffies = %llu\n", hrtimer_jiffies);
-	
+	struct emulate_nvm_delay_state *state;
+	struct emulate_nvm_cpu_stat *stat;
+	struct emulate_nvm_params params;
+	struct emulate_nvm_ctx *ctx;
+	u64 cycles;
+	int cpu;
+
+	seq_printf(m, "attribution = %s, injection = %s\n",
+		emulate_nvm_attribution_name(),
+		emulate_nvm_overflow_sampling() ? "overflow" :
+		(self_hosted || emulate_nvm_per_core()) ? "self-hosted" : "ipi");
+
+	/* One line per context, in the same format it is written */
+	for_each_emulate_nvm_ctx(ctx) {
+		emulate_nvm_get_params(ctx, &params);
+		seq_printf(m, "node=%d dram_read_ns=%llu nvm_read_ns=%llu "
+			"dram_write_ns=%llu nvm_write_ns=%llu epoch_ns=%llu model=%s cpus=%*pbl\n",
+			ctx->node, params.dram_read_ns, params.nvm_read_ns,
+			params.dram_write_ns, params.nvm_write_ns, params.epoch_ns,
+			params.model->name, cpumask_pr_args(&ctx->cpus));
+		seq_printf(m, "        profile = %s, bandwidth cap = %lu/%lu MB/s read/write, "
+			"throttle = 1/%u, THRT_PWR = 0x%03x, granularity = %u B\n",
+			emulate_nvm_profile_name(ctx->profile), ctx->read_bw_mbps,
+			ctx->write_bw_mbps, ctx->throttle, ctx->thrt_pwr,
+			ctx->granularity);
+		if (closed_loop)
+			seq_printf(m, "        loaded read latency = %llu ns, idle = %llu ns (TOR)\n",
+				READ_ONCE(ctx->measured_read_ns),
+				READ_ONCE(ctx->idle_read_ns));
+		if (emulate_nvm_imc_wanted())
+			seq_printf(m, "        bandwidth = %llu MB/s, queueing = %llu ns\n",
+				READ_ONCE(ctx->bw_mbps), READ_ONCE(ctx->queue_ns));
+		if (bw_control)
+			seq_printf(m, "        bandwidth control = %lu MB/s target, THRT_PWR = 0x%03x\n",
+				READ_ONCE(ctx->read_bw_mbps), READ_ONCE(ctx->thrt_pwr));
+		if (write_amp)
+			seq_printf(m, "        write amplification = %u%%, extra = %llu ns per write\n",
+				READ_ONCE(ctx->wa_pct), READ_ONCE(ctx->wa_write_ns));
+		if (write_buffer)
+			seq_printf(m, "        write buffer = %u B, hits = %u%%\n",
+				READ_ONCE(ctx->wcb_bytes), READ_ONCE(ctx->wcb_hit_pct));
+		if (row_buffer)
+			seq_printf(m, "        row hit = %llu ns, hits = %u%%\n",
+				READ_ONCE(ctx->row_hit_ns), READ_ONCE(ctx->row_hit_pct));
+		if (write_limit)
+			seq_printf(m, "        write limit = %lu MB/s, wait = %llu ns per write\n",
+				READ_ONCE(ctx->write_bw_mbps), READ_ONCE(ctx->wr_limit_ns));
+	}
+
+	/*
+	 * One line per emulated cpu. The epoch overhead excludes the
+	 * injected delay, in TSC cycles and ns. emulate_nvm_set_cpus()
+	 * may be changing the set under us.
+	 */
+	mutex_lock(&emulate_nvm_cpus_mutex);
+	for_each_cpu(cpu, &emulate_nvm_cpus) {
+		stat = per_cpu_ptr(&emulate_nvm_cpu_stats, cpu);
+		state = per_cpu_ptr(&emulate_nvm_delay_states, cpu);
+
+		cycles = stat->epochs ? div64_u64(stat->overhead_cycles, stat->epochs) : 0;
+
+		seq_printf(m, "CPU %2d, node = %d, epochs = %llu, epoch = %llu ns, reads = %llu, "
+			"writes = %llu, stall = %llu ns, delay = %llu ns\n",
+			cpu, stat->ctx ? stat->ctx->node : -1,
+			stat->epochs, stat->epoch_ns, stat->reads,
+			stat->writes, stat->stall_ns, stat->delay_ns);
+		seq_printf(m, "        delay requested = %llu ns, achieved = %llu ns, carry = %lld ns, "
+			"dropped = %llu ns\n", state->requested_ns, state->achieved_ns,
+			state->carry_ns, state->dropped_ns);
+		seq_printf(m, "        epoch overhead = %llu cycles (%llu ns)\n", cycles,
+			tsc_khz ? div64_u64(cycles * 1000000, tsc_khz) : 0);
+	}
+	mutex_unlock(&emulate_nvm_cpus_mutex);
+
 	return 0;
 }
 
@@ -49,24 +118,163 @@ static int emulate_nvm_proc_open(struct inode *inode, struct file *file)
 	return single_open(file, emulate_nvm_proc_show, NULL);
 }
 
+/* Parameters that can be written as key=value, all in ns */
+static const struct {
+	const char	*key;
+	size_t		offset;
+} emulate_nvm_proc_keys[] = {
+	{ "dram_read_ns",	offsetof(struct emulate_nvm_params, dram_read_ns)	},
+	{ "nvm_read_ns",	offsetof(struct emulate_nvm_params, nvm_read_ns)	},
+	{ "dram_write_ns",	offsetof(struct emulate_nvm_params, dram_write_ns)	},
+	{ "nvm_write_ns",	offsetof(struct emulate_nvm_params, nvm_write_ns)	},
+	{ "epoch_ns",		offsetof(struct emulate_nvm_params, epoch_ns)		},
+};
+
+static int emulate_nvm_proc_parse(char *tok, struct emulate_nvm_params *params,
+				  struct cpumask *cpus, bool *set_cpus,
+				  const struct emulate_nvm_profile **profile)
+{
+	char *val;
+	int i;
+
+	val = strchr(tok, '=');
+	if (!val)
+		return -EINVAL;
+	*val++ = '\0';
+
+	if (!strcmp(tok, "cpus")) {
+		*set_cpus = true;
+		return cpulist_parse(val, cpus);
+	}
+
+	/* Latencies now, the rest once everything is checked */
+	if (!strcmp(tok, "profile")) {
+		*profile = emulate_nvm_find_profile(val);
+		if (!*profile)
+			return -EINVAL;
+		emulate_nvm_profile_params(*profile, params);
+		return 0;
+	}
+
+	if (!strcmp(tok, "model")) {
+		params->model = emulate_nvm_find_model(val);
+		return params->model ? 0 : -EINVAL;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(emulate_nvm_proc_keys); i++) {
+		if (!strcmp(tok, emulate_nvm_proc_keys[i].key))
+			return kstrtoull(val, 0, (u64 *)((char *)params +
+					 emulate_nvm_proc_keys[i].offset));
+	}
+
+	return -EINVAL;
+}
+
+/*
+ * Write one or more "key=value" pairs, separated by spaces, e.g.
+ *
+ *	echo "nvm_read_ns=500 nvm_write_ns=2000 epoch_ns=10000000" > /proc/emulate_nvm
+ *	echo "cpus=0-5,8" > /proc/emulate_nvm
+ *	echo "model=table" > /proc/emulate_nvm
+ *	echo "profile=optane" > /proc/emulate_nvm
+ *
+ * A write changes one context, picked by "node=<NVM node>", the first one if
+ * not given:
+ *
+ *	echo "node=3 nvm_read_ns=800" > /proc/emulate_nvm
+ *
+ * Pairs are applied left to right, so "profile=optane nvm_read_ns=400" is an
+ * Optane with slower reads. All pairs of one write are applied together, or
+ * none of them is (a profile failing to throttle is the exception). Running
+ * hrtimers are not stopped, new latencies take effect at the next epoch.
+ *
+ * epoch_ns must be within [min_epoch_ns, max_epoch_ns] of the module, and
+ * cpus must sit on the cpu node of the context.
+ */
+#define EMULATE_NVM_PROC_MAX_TOKENS	16
+
 static ssize_t emulate_nvm_proc_write(struct file *file, const char __user *buf,
 				   size_t count, loff_t *offs)
 {
-	char ctl[2];
-	
-	if (count !=2 || *offs)
+	char *toks[EMULATE_NVM_PROC_MAX_TOKENS];
+	struct emulate_nvm_ctx *ctx = emulate_nvm_ctxs;
+	const struct emulate_nvm_profile *profile = NULL;
+	struct emulate_nvm_params params;
+	cpumask_var_t cpus;
+	bool set_cpus = false;
+	char *kbuf, *p, *tok;
+	int i, node, nr_toks = 0;
+	int ret;
+
+	if (!count || count > PAGE_SIZE || *offs)
 		return -EINVAL;
-	
-	if (copy_from_user(ctl, buf, count))
-		return -EFAULT;
-	
-	switch (ctl[0]) {
-		/*TODO modify parameters */
-		default:
-			count = -EINVAL;
+
+	kbuf = kzalloc(count + 1, GFP_KERNEL);
+	if (!kbuf)
+		return -ENOMEM;
+
+	if (!alloc_cpumask_var(&cpus, GFP_KERNEL)) {
+		kfree(kbuf);
+		return -ENOMEM;
+	}
+
+	if (copy_from_user(kbuf, buf, count)) {
+		ret = -EFAULT;
+		goto out;
 	}
 
-	return count;
+	ret = -EINVAL;
+	p = strim(kbuf);
+	while ((tok = strsep(&p, " \t\n")) != NULL) {
+		if (!*tok)
+			continue;
+		if (nr_toks == EMULATE_NVM_PROC_MAX_TOKENS)
+			goto out;
+
+		/* Context first, everything else is relative to it */
+		if (!strncmp(tok, "node=", 5)) {
+			if (kstrtoint(tok + 5, 0, &node))
+				goto out;
+			ctx = emulate_nvm_find_ctx(node);
+			if (!ctx)
+				goto out;
+			continue;
+		}
+		toks[nr_toks++] = tok;
+	}
+
+	emulate_nvm_get_params(ctx, &params);
+
+	for (i = 0; i < nr_toks; i++) {
+		ret = emulate_nvm_proc_parse(toks[i], &params, cpus, &set_cpus,
+					     &profile);
+		if (ret)
+			goto out;
+	}
+
+	/* Check before touching anything, so it is all or nothing */
+	ret = -EINVAL;
+	if (!emulate_nvm_params_valid(&params))
+		goto out;
+
+	if (set_cpus) {
+		ret = emulate_nvm_set_cpus(ctx, cpus);
+		if (ret)
+			goto out;
+	}
+
+	if (profile) {
+		ret = emulate_nvm_set_profile(ctx, profile);
+		if (ret)
+			goto out;
+	}
+
+	ret = emulate_nvm_set_params(ctx, &params);
+
+out:
+	free_cpumask_var(cpus);
+	kfree(kbuf);
+	return ret ? ret : count;
 }
 
 const struct file_operations emulate_nvm_proc_fops = {
@@ -81,7 +289,7 @@ static bool is_proc_registed = false;
 
 int __must_check emulate_nvm_proc_create(void)
 {
-	if (proc_create("emulate_nvm", 0444, NULL, &emulate_nvm_proc_fops)) {
+	if (proc_create("emulate_nvm", 0644, NULL, &emulate_nvm_proc_fops)) {
 		is_proc_registed = true;
 		return 0;
 	}
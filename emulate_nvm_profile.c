@@ -0,0 +1,207 @@
+/*
+ *	Copyright (C) 2015-2016 Yizhou Shan <shanyizhou@ict.ac.cn>
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; either version 2 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License along
+ *	with this program; if not, write to the Free Software Foundation, Inc.,
+ *	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Device profiles. Instead of three latencies and a throttle ratio, pick a
+ * device by name, and get latencies, bandwidths, media granularity, write
+ * and row buffers and the queueing curve that go together:
+ *
+ *	insmod uncore.ko profile=optane,cxl nvm_node=2,3
+ *	echo "node=3 profile=pcm" > /proc/emulate_nvm
+ *
+ * Read bandwidth becomes the IMC throttle closest to it (exact on a calibrated
+ * node, see emulate_nvm_calibrate.c), and it is also the cap the queueing
+ * model measures utilization against. Numbers are rough,
+ * from published measurements of such devices, on a whole socket.
+ *
+ * Latencies below the DRAM ones (e.g. Optane writes, which land in the ADR
+ * buffer) are raised to DRAM latency, the emulator can only add.
+ */
+
+#define pr_fmt(fmt) "EMULATE NVM: " fmt
+
+#include "uncore_pmu.h"
+#include "emulate_nvm.h"
+
+#include <linux/types.h>
+#include <linux/errno.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+
+/* How far the achieved read bandwidth may be off the profile, in percent */
+#define PROFILE_BW_SLACK_PCT		10
+
+/**
+ * struct emulate_nvm_profile
+ * @name:		Name in profile= and /proc/emulate_nvm
+ * @read_ns:		Idle read latency
+ * @write_ns:		Idle write latency
+ * @read_bw_mbps:	Peak read bandwidth
+ * @write_bw_mbps:	Peak write bandwidth
+ * @granularity:	Media access granularity in bytes
+ * @wcb_bytes:		Write-combining buffer per channel, 0 if none
+ * @wcb_hit_ns:		Write latency when absorbed by that buffer
+ * @row_hit_ns:		Read latency on a row buffer hit, 0 if not modelled
+ * @queue_curve:	Queueing delay curve, util%:ns, see emulate_nvm_queue.c
+ * @curve:		Parsed @queue_curve
+ */
+struct emulate_nvm_profile {
+	const char		*name;
+	u64			read_ns;
+	u64			write_ns;
+	unsigned long		read_bw_mbps;
+	unsigned long		write_bw_mbps;
+	unsigned int		granularity;
+	unsigned int		wcb_bytes;
+	u64			wcb_hit_ns;
+	u64			row_hit_ns;
+	const char		*queue_curve;
+	struct emulate_nvm_curve curve;
+};
+
+static struct emulate_nvm_profile emulate_nvm_profiles[] = {
+	{
+		.name		= "optane",
+		.read_ns	= 305,
+		.write_ns	= 94,
+		.read_bw_mbps	= 39000,
+		.write_bw_mbps	= 13000,
+		.granularity	= 256,
+		.wcb_bytes	= 16384,
+		.wcb_hit_ns	= 100,
+		.row_hit_ns	= 0,
+		.queue_curve	= "0:0,40:20,60:60,75:150,85:400,95:1000",
+	},
+	{
+		.name		= "pcm",
+		.read_ns	= 350,
+		.write_ns	= 1000,
+		.read_bw_mbps	= 20000,
+		.write_bw_mbps	= 4000,
+		.granularity	= 64,
+		.wcb_bytes	= 4096,
+		.wcb_hit_ns	= 150,
+		.row_hit_ns	= 120,
+		.queue_curve	= "0:0,50:20,70:60,85:200,95:600",
+	},
+	{
+		.name		= "cxl",
+		.read_ns	= 250,
+		.write_ns	= 250,
+		.read_bw_mbps	= 30000,
+		.write_bw_mbps	= 30000,
+		.granularity	= 64,
+		.wcb_bytes	= 0,
+		.wcb_hit_ns	= 0,
+		.row_hit_ns	= 0,
+		.queue_curve	= "0:0,50:10,70:30,85:80,95:200",
+	},
+};
+
+/**
+ * emulate_nvm_profile_init
+ * Return:	Non-zero on failure
+ */
+int emulate_nvm_profile_init(void)
+{
+	struct emulate_nvm_profile *profile;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(emulate_nvm_profiles); i++) {
+		profile = &emulate_nvm_profiles[i];
+		if (emulate_nvm_curve_parse(&profile->curve, profile->queue_curve)) {
+			pr_err("Invalid queue curve of profile %s", profile->name);
+			return -EINVAL;
+		}
+	}
+	return 0;
+}
+
+/* The profile called @name, or NULL */
+const struct emulate_nvm_profile *emulate_nvm_find_profile(const char *name)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(emulate_nvm_profiles); i++) {
+		if (!strcmp(name, emulate_nvm_profiles[i].name))
+			return &emulate_nvm_profiles[i];
+	}
+	return NULL;
+}
+
+const char *emulate_nvm_profile_name(const struct emulate_nvm_profile *profile)
+{
+	return profile ? profile->name : "custom";
+}
+
+/**
+ * emulate_nvm_profile_params
+ * @profile:	the device
+ * @params:	parameters to fill, DRAM latencies must be there already
+ *
+ * Only fills @params, nothing is published.
+ */
+void emulate_nvm_profile_params(const struct emulate_nvm_profile *profile,
+				struct emulate_nvm_params *params)
+{
+	params->nvm_read_ns = max(profile->read_ns, params->dram_read_ns);
+	params->nvm_write_ns = max(profile->write_ns, params->dram_write_ns);
+}
+
+/**
+ * emulate_nvm_set_profile
+ * @ctx:	the context
+ * @profile:	the device
+ * Return:	Non-zero on failure
+ *
+ * Throttle NVM node of @ctx to the bandwidth of @profile, and give its
+ * write bandwidth, granularity and queueing curve to @ctx. @ctx keeps the
+ * read bandwidth the throttle really gives, which is what the queueing model
+ * has to work with, and it warns if that is far from the profile. Latencies
+ * go through emulate_nvm_profile_params() and emulate_nvm_set_params().
+ */
+int emulate_nvm_set_profile(struct emulate_nvm_ctx *ctx,
+			    const struct emulate_nvm_profile *profile)
+{
+	unsigned long achieved;
+	int ret;
+
+	ret = emulate_nvm_set_bandwidth(ctx, profile->read_bw_mbps);
+	if (ret)
+		return ret;
+
+	achieved = READ_ONCE(ctx->read_bw_mbps);
+	if (achieved * 100 < profile->read_bw_mbps * (100 - PROFILE_BW_SLACK_PCT) ||
+	    achieved * 100 > profile->read_bw_mbps * (100 + PROFILE_BW_SLACK_PCT))
+		pr_warn("Node %d can not do %lu MB/s of %s, it gets %lu MB/s",
+			ctx->node, profile->read_bw_mbps, profile->name, achieved);
+
+	WRITE_ONCE(ctx->write_bw_mbps, profile->write_bw_mbps);
+	WRITE_ONCE(ctx->granularity, profile->granularity);
+	WRITE_ONCE(ctx->wcb_bytes, profile->wcb_bytes);
+	WRITE_ONCE(ctx->wcb_hit_ns, profile->wcb_hit_ns);
+	WRITE_ONCE(ctx->row_hit_ns, profile->row_hit_ns);
+	WRITE_ONCE(ctx->queue_curve, &profile->curve);
+	ctx->profile = profile;
+
+	pr_info("Node %d is %s now: %lu/%lu MB/s read/write, %lu MB/s read achieved (throttle 1/%u, THRT_PWR 0x%03x), %u B media",
+		ctx->node, profile->name, profile->read_bw_mbps,
+		profile->write_bw_mbps, achieved, ctx->throttle, ctx->thrt_pwr,
+		profile->granularity);
+	return 0;
+}
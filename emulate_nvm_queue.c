@@ -0,0 +1,103 @@
+/*
+ *	Copyright (C) 2015-2016 Yizhou Shan <shanyizhou@ict.ac.cn>
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; either version 2 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License along
+ *	with this program; if not, write to the Free Software Foundation, Inc.,
+ *	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Loaded-latency (queueing) model. Latency and bandwidth used to be emulated
+ * apart: a fixed delta per miss, and an IMC throttle. But NVM latency goes up
+ * steeply when bandwidth gets close to what the device can do, and a throttled
+ * DRAM node does not show that on its own.
+ *
+ * So every epoch, CAS_COUNT.RD and CAS_COUNT.WR of all IMC channels of the NVM
+ * node (see emulate_nvm_imc.c) are turned into utilization of the emulated
+ * read and write bandwidth:
+ *
+ *   util = rd * 64B / epoch / read_bw + wr * 64B / epoch / write_bw
+ *
+ * Both are dram_bw_mbps / throttle, unless a device profile or nvm_bw_mbps
+ * says otherwise.
+ * The queueing delay is looked up in queue_curve (or the curve of the device
+ * profile), piecewise linear in util.
+ * The queueing latency model adds it to every read and write:
+ *
+ *	insmod uncore.ko queue_model=1 queue_curve="0:0,50:10,80:80,95:400"
+ *
+ * queue_model also makes queueing the default latency model.
+ */
+
+#define pr_fmt(fmt) "EMULATE NVM: " fmt
+
+#include "emulate_nvm.h"
+
+#include <linux/types.h>
+#include <linux/errno.h>
+#include <linux/kernel.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+
+bool queue_model = false;
+module_param(queue_model, bool, 0444);
+MODULE_PARM_DESC(queue_model, "Add queueing delay from IMC bandwidth utilization (default: false)");
+
+static char *queue_curve = "0:0,50:10,70:40,80:80,90:200,95:400";
+module_param(queue_curve, charp, 0444);
+MODULE_PARM_DESC(queue_curve, "Queueing delay curve, util%:ns points in ascending util (default: 0:0,50:10,70:40,80:80,90:200,95:400)");
+
+static struct emulate_nvm_curve queue_curve_points;
+
+/**
+ * emulate_nvm_queue_epoch
+ * @ctx:	the context, on its first emulated cpu
+ * @rd_mbps:	read bandwidth of NVM node in this epoch
+ * @media_mbps:	write bandwidth of NVM node in this epoch, as the media sees it
+ *
+ * The queueing delay of that bandwidth, for the queueing latency model.
+ */
+void emulate_nvm_queue_epoch(struct emulate_nvm_ctx *ctx, u64 rd_mbps,
+			     u64 media_mbps)
+{
+	const struct emulate_nvm_curve *curve;
+	unsigned long read_bw_mbps, write_bw_mbps;
+	u64 util = 0;
+
+	/* A profile may be switching under us, any consistent-enough pair will do */
+	read_bw_mbps = READ_ONCE(ctx->read_bw_mbps);
+	write_bw_mbps = READ_ONCE(ctx->write_bw_mbps);
+	if (read_bw_mbps)
+		util += div64_u64(rd_mbps * 100, read_bw_mbps);
+	if (write_bw_mbps)
+		util += div64_u64(media_mbps * 100, write_bw_mbps);
+
+	curve = READ_ONCE(ctx->queue_curve);
+	if (!curve)
+		curve = &queue_curve_points;
+
+	WRITE_ONCE(ctx->queue_ns, emulate_nvm_curve_lookup(curve, util));
+}
+
+/**
+ * emulate_nvm_queue_init
+ * Return:	Non-zero on failure
+ */
+int emulate_nvm_queue_init(void)
+{
+	if (emulate_nvm_curve_parse(&queue_curve_points, queue_curve)) {
+		pr_err("Invalid queue_curve: %s", queue_curve);
+		return -EINVAL;
+	}
+	return 0;
+}
@@ -0,0 +1,91 @@
+/*
+ *	Copyright (C) 2015-2016 Yizhou Shan <shanyizhou@ict.ac.cn>
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; either version 2 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License along
+ *	with this program; if not, write to the Free Software Foundation, Inc.,
+ *	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Row-buffer-aware read penalty. PCM-like media pay the slow array read only
+ * on a row buffer miss, a hit costs about as much as DRAM. Charging
+ * nvm_read_ns to every read makes sequential scans far too slow.
+ *
+ * The row buffer behaviour of NVM node is taken from its DRAM: each channel
+ * counts RD_CAS and ACT.RD, and a RD_CAS without an ACT hit an open row.
+ *
+ *   hits = RD_CAS - ACT.RD
+ *
+ * nvm_read_ns is the miss latency, row_hit_ns of the device profile is the
+ * hit one, and the read delta is blended by the hit ratio of the last epoch.
+ * A profile without row_hit_ns (or no profile) changes nothing.
+ *
+ * PRE is not counted. The four counters of an IMC box are all taken (CAS.RD,
+ * CAS.WR, ACT.WR, ACT.RD), and every ACT is paired with a PRE anyway.
+ */
+
+#define pr_fmt(fmt) "EMULATE NVM: " fmt
+
+#include "emulate_nvm.h"
+
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+
+bool row_buffer = false;
+module_param(row_buffer, bool, 0444);
+MODULE_PARM_DESC(row_buffer, "Charge NVM read latency on row buffer misses only, row hits pay row_hit_ns of the profile (default: false)");
+
+/**
+ * emulate_nvm_rowbuf_epoch
+ * @ctx:	the context, on its first emulated cpu
+ * @rd:		RD_CAS of NVM node in this epoch
+ * @act_rd:	ACT.RD of NVM node in this epoch
+ */
+void emulate_nvm_rowbuf_epoch(struct emulate_nvm_ctx *ctx, u64 rd, u64 act_rd)
+{
+	u64 hits;
+
+	if (!READ_ONCE(ctx->row_hit_ns) || !rd) {
+		WRITE_ONCE(ctx->row_hit_pct, 0);
+		return;
+	}
+
+	hits = rd > act_rd ? rd - act_rd : 0;
+	WRITE_ONCE(ctx->row_hit_pct, div64_u64(hits * 100, rd));
+}
+
+/**
+ * emulate_nvm_rowbuf_correct
+ * @ctx:	the context of this cpu
+ * @params:	snapshot of the parameters of this epoch
+ *
+ * Blend the read delta of row hits into the one of row misses.
+ */
+void emulate_nvm_rowbuf_correct(struct emulate_nvm_ctx *ctx,
+				struct emulate_nvm_params *params)
+{
+	unsigned int hit_pct = READ_ONCE(ctx->row_hit_pct);
+	u64 hit_ns = READ_ONCE(ctx->row_hit_ns), hit_delta_ns = 0;
+
+	if (!hit_pct)
+		return;
+
+	if (hit_ns > params->dram_read_ns)
+		hit_delta_ns = hit_ns - params->dram_read_ns;
+	hit_delta_ns = min(hit_delta_ns, params->read_delta_ns);
+
+	params->read_delta_ns = div_u64(params->read_delta_ns * (100 - hit_pct) +
+					hit_delta_ns * hit_pct, 100);
+}
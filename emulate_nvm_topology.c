@@ -0,0 +1,283 @@
+/*
+ *	Copyright (C) 2015-2016 Yizhou Shan <shanyizhou@ict.ac.cn>
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; either version 2 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License along
+ *	with this program; if not, write to the Free Software Foundation, Inc.,
+ *	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Topology of the emulation. Which nodes play NVM, which cpus run with the
+ * latency of each of them, and which cpu polls (HA attribution without
+ * self-hosted only). All of them can be given as module parameters, or left
+ * to us to discover. Whatever is given or discovered is validated against the
+ * uncore topology, so the same module works on 2- and 4-socket machines
+ * without recompiling.
+ *
+ * The picture is always the same: cpus of one node access memory of another
+ * node, which is the NVM node, through QPI. The HA box of NVM node counts the
+ * remote requests, the IMC of NVM node is throttled. Each such pair is an
+ * emulation context, there can be several of them at the same time:
+ *
+ *	insmod uncore.ko nvm_node=2,3 emulate_cpus="0-17;18-35"
+ *
+ * Neither the HA box nor OFFCORE_RESPONSE can tell which remote node a request
+ * goes to, so cpus of a context should only touch memory of its NVM node
+ * (e.g. numactl --membind).
+ */
+
+#define pr_fmt(fmt) "EMULATE NVM: " fmt
+
+#include "uncore_pmu.h"
+#include "emulate_nvm.h"
+
+#include <linux/cpu.h>
+#include <linux/slab.h>
+#include <linux/errno.h>
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/string.h>
+#include <linux/cpumask.h>
+#include <linux/nodemask.h>
+#include <linux/topology.h>
+
+/* Empty means pick one for me */
+static int nvm_nodes[EMULATE_NVM_MAX_CTX];
+static int nr_nvm_nodes;
+module_param_array_named(nvm_node, nvm_nodes, int, &nr_nvm_nodes, 0444);
+MODULE_PARM_DESC(nvm_node, "Nodes whose memory is emulated as NVM, one context each (default: first node other than the emulated one)");
+
+static char *emulate_cpus = "";
+module_param(emulate_cpus, charp, 0444);
+MODULE_PARM_DESC(emulate_cpus, "Cpulists running with NVM latency, one per nvm_node separated by ';', each on one node (default: all cpus of a non-NVM node)");
+
+static int polling_cpu_param = -1;
+module_param_named(polling_cpu, polling_cpu_param, int, 0444);
+MODULE_PARM_DESC(polling_cpu, "Cpu polling the HA boxes when not self-hosted (default: -1, last cpu of the first NVM node)");
+
+/*
+ * Does this node have an uncore PCI bus, and an HA box on it? If not, the
+ * emulator can not count its requests.
+ */
+static bool emulate_nvm_node_has_uncore(int node)
+{
+	int bus;
+
+	if (node < 0 || node >= UNCORE_MAX_SOCKET || !node_online(node))
+		return false;
+
+	for (bus = 0; bus < 256; bus++) {
+		if (uncore_pcibus_to_nodeid[bus] == node)
+			break;
+	}
+	if (bus == 256)
+		return false;
+
+	return uncore_get_first_box(uncore_pci_type[UNCORE_PCI_HA_ID], node) != NULL;
+}
+
+static bool is_nvm_node(int node)
+{
+	int i;
+
+	for (i = 0; i < nr_nvm_nodes; i++) {
+		if (nvm_nodes[i] == node)
+			return true;
+	}
+	return false;
+}
+
+/* The @nth online node that is not an NVM node */
+static int nth_cpu_node(int nth)
+{
+	int node;
+
+	for_each_online_node(node) {
+		if (is_nvm_node(node))
+			continue;
+		if (!nth--)
+			return node;
+	}
+	return -1;
+}
+
+/* Parse one cpulist of emulate_cpus, or fall back to all cpus of a node */
+static int emulate_nvm_topology_cpus(struct emulate_nvm_ctx *ctx, char *list,
+				     int nth)
+{
+	struct cpumask *cpus = &ctx->cpus;
+	int cpu, node;
+
+	if (list && *list) {
+		if (cpulist_parse(list, cpus)) {
+			pr_err("Invalid emulate_cpus: %s", list);
+			return -EINVAL;
+		}
+		if (cpumask_empty(cpus) || !cpumask_subset(cpus, cpu_online_mask)) {
+			pr_err("emulate_cpus must be online: %s", list);
+			return -EINVAL;
+		}
+	} else {
+		node = nth_cpu_node(nth);
+		if (node < 0) {
+			pr_err("No node left for cpus of context %d", nth);
+			return -ENXIO;
+		}
+		cpumask_and(cpus, cpumask_of_node(node), cpu_online_mask);
+	}
+
+	/* One node only, C-Box and offline logic are per-socket */
+	ctx->cpu = cpumask_first(cpus);
+	ctx->cpu_node = cpu_to_node(ctx->cpu);
+	for_each_cpu(cpu, cpus) {
+		if (cpu_to_node(cpu) != ctx->cpu_node) {
+			pr_err("emulate_cpus must be on one node: %*pbl",
+				cpumask_pr_args(cpus));
+			return -EINVAL;
+		}
+	}
+
+	if (cpumask_intersects(cpus, &emulate_nvm_cpus)) {
+		pr_err("emulate_cpus of two contexts overlap");
+		return -EINVAL;
+	}
+
+	/* HA box can only serve one cpu */
+	if (!emulate_nvm_per_core() && cpumask_weight(cpus) > 1) {
+		pr_warn("HA attribution emulates one cpu, using CPU%2d", ctx->cpu);
+		cpumask_copy(cpus, cpumask_of(ctx->cpu));
+	}
+
+	return 0;
+}
+
+static int emulate_nvm_topology_ctx(struct emulate_nvm_ctx *ctx, char *list,
+				    int nth)
+{
+	int node, ret;
+
+	ret = emulate_nvm_topology_cpus(ctx, list, nth);
+	if (ret)
+		return ret;
+
+	if (nth < nr_nvm_nodes)
+		ctx->node = nvm_nodes[nth];
+	else {
+		/* Only when nvm_node is not given, so there is one context */
+		ctx->node = -1;
+		for_each_online_node(node) {
+			if (node != ctx->cpu_node &&
+			    emulate_nvm_node_has_uncore(node)) {
+				ctx->node = node;
+				break;
+			}
+		}
+	}
+
+	if (ctx->node == ctx->cpu_node) {
+		pr_err("NVM node %d is where its emulated cpus are", ctx->node);
+		return -EINVAL;
+	}
+	if (!emulate_nvm_node_has_uncore(ctx->node)) {
+		pr_err("No uncore HA box for NVM node %d", ctx->node);
+		return -ENXIO;
+	}
+	if (emulate_nvm_find_ctx(ctx->node) != ctx) {
+		pr_err("NVM node %d given twice", ctx->node);
+		return -EINVAL;
+	}
+
+	cpumask_or(&emulate_nvm_cpus, &emulate_nvm_cpus, &ctx->cpus);
+
+	return 0;
+}
+
+/**
+ * emulate_nvm_topology_init
+ * Return:	Non-zero on failure
+ *
+ * Fill emulate_nvm_ctxs, emulate_nvm_cpus, polling_cpu and polling_node from
+ * module parameters or discovery.
+ */
+int emulate_nvm_topology_init(void)
+{
+	struct emulate_nvm_ctx *ctx;
+	char *lists, *p, *list;
+	int cpu, i, ret;
+
+	cpumask_clear(&emulate_nvm_cpus);
+	nr_emulate_nvm_ctxs = nr_nvm_nodes ? nr_nvm_nodes : 1;
+
+	/* The C-Box engine watches one socket */
+	if (attribution_mode == EMULATE_NVM_ATTR_CBOX && nr_emulate_nvm_ctxs > 1) {
+		pr_err("C-Box attribution supports one NVM node only");
+		return -EINVAL;
+	}
+
+	lists = kstrdup(emulate_cpus, GFP_KERNEL);
+	if (!lists)
+		return -ENOMEM;
+
+	p = lists;
+	for (i = 0; i < nr_emulate_nvm_ctxs; i++) {
+		ctx = &emulate_nvm_ctxs[i];
+		ctx->node = -1;
+		list = strsep(&p, ";");
+		ret = emulate_nvm_topology_ctx(ctx, list, i);
+		if (ret)
+			goto out;
+	}
+	if (p) {
+		pr_err("More emulate_cpus than nvm_node");
+		ret = -EINVAL;
+		goto out;
+	}
+
+	/* Polling cpu lives on first NVM node, it is never offlined there */
+	if (polling_cpu_param < 0) {
+		polling_cpu = nr_cpu_ids;
+		for_each_cpu(cpu, cpumask_of_node(emulate_nvm_ctxs[0].node))
+			polling_cpu = cpu;
+	} else
+		polling_cpu = polling_cpu_param;
+
+	ret = 0;
+	if (polling_cpu >= nr_cpu_ids || !cpu_online(polling_cpu) ||
+	    cpumask_test_cpu(polling_cpu, &emulate_nvm_cpus)) {
+		/* Only fatal if we are going to poll */
+		if (!self_hosted && !emulate_nvm_per_core()) {
+			pr_err("Invalid polling cpu %d", polling_cpu);
+			ret = -EINVAL;
+			goto out;
+		}
+		polling_cpu = emulate_nvm_ctxs[0].cpu;
+	}
+	polling_node = cpu_to_node(polling_cpu);
+
+	/* Other cpus of emulated nodes are offlined with HA attribution */
+	if (!self_hosted && !emulate_nvm_per_core()) {
+		for_each_emulate_nvm_ctx(ctx) {
+			if (polling_node == ctx->cpu_node) {
+				pr_err("Polling cpu %d is on emulated node %d",
+					polling_cpu, polling_node);
+				ret = -EINVAL;
+				goto out;
+			}
+		}
+	}
+
+out:
+	kfree(lists);
+	return ret;
+}
@@ -0,0 +1,266 @@
+/*
+ *	Copyright (C) 2015-2016 Yizhou Shan <shanyizhou@ict.ac.cn>
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; either version 2 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License along
+ *	with this program; if not, write to the Free Software Foundation, Inc.,
+ *	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Closed-loop latency correction. Calibration measures DRAM latency once, on
+ * an idle machine, but loaded latency grows with bandwidth. So we measure it
+ * every epoch, from the C-Boxes of the emulated socket:
+ *
+ *   latency (uncore cycles) = TOR_OCCUPANCY.MISS_REMOTE / TOR_INSERTS.MISS_REMOTE
+ *
+ * which is Little's law: the average number of remote misses in flight over
+ * the rate they come in. The U-Box fixed counter turns uncore cycles into ns.
+ *
+ * TOR latency is not what calibration measured: it starts at the C-Box, not
+ * at the core, and leaves out the way back. So it is not used as is, only its
+ * drift from an idle baseline taken the same way at start:
+ *
+ *   dram_read_ns' = dram_read_ns + (measured - idle)
+ *
+ * The injected delta is target - dram_read_ns', and the NVM latency
+ * applications see stays at target even when the DRAM node is congested.
+ * The idle baseline is sampled for TOR_IDLE_MS right after the counters are
+ * set up. If that saw too few misses, the first epoch that does is taken.
+ *
+ * TOR_OCCUPANCY can only use counter 0, inserts go to counter 1. Counter 2 is
+ * used by C-Box attribution, they live together fine.
+ *
+ * MSRs of C-Box are per-socket, and the box structures are shared by all
+ * sockets. So everything runs on the first emulated cpu of a context, and the
+ * last raw values are kept here, per context.
+ */
+
+#define pr_fmt(fmt) "EMULATE NVM: " fmt
+
+#include "uncore_pmu.h"
+#include "emulate_nvm.h"
+
+#include <linux/smp.h>
+#include <linux/ktime.h>
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+#include <linux/delay.h>
+
+extern struct uncore_event cbox_tor_inserts_miss_remote;
+extern struct uncore_event cbox_tor_occupancy_miss_remote;
+
+bool closed_loop = false;
+module_param(closed_loop, bool, 0444);
+MODULE_PARM_DESC(closed_loop, "Measure loaded remote latency with C-Box TOR (Little's law) every epoch, and inject target - measured (default: false)");
+
+#define TOR_OCC_CTR			0
+#define TOR_INS_CTR			1
+
+#define TOR_MAX_BOXES			32
+
+/* Too few misses in an epoch say nothing, keep the last estimate */
+#define TOR_MIN_INSERTS			64
+
+/* Idle baseline window at start */
+#define TOR_IDLE_MS			100
+
+struct emulate_nvm_tor {
+	u64	occ[TOR_MAX_BOXES];
+	u64	ins[TOR_MAX_BOXES];
+	u64	uclk;
+	u64	ns;
+};
+
+static struct emulate_nvm_tor emulate_nvm_tors[EMULATE_NVM_MAX_CTX];
+
+static struct uncore_box *tor_cboxes[TOR_MAX_BOXES];
+static unsigned int nr_tor_cboxes;
+static struct uncore_box *tor_ubox;
+
+static inline struct emulate_nvm_tor *ctx_to_tor(struct emulate_nvm_ctx *ctx)
+{
+	return &emulate_nvm_tors[ctx - emulate_nvm_ctxs];
+}
+
+static inline u64 tor_delta(struct uncore_box *box, u64 now, u64 *prev)
+{
+	u64 delta = (now - *prev) & uncore_box_ctr_mask(box);
+
+	*prev = now;
+	return delta;
+}
+
+/**
+ * emulate_nvm_tor_epoch
+ * @ctx:	the context, must run on its first emulated cpu
+ *
+ * Read all C-Boxes and the U-Box clock of this socket, and update the loaded
+ * remote read latency of @ctx.
+ */
+static void emulate_nvm_tor_epoch(struct emulate_nvm_ctx *ctx)
+{
+	struct emulate_nvm_tor *tor = ctx_to_tor(ctx);
+	u64 now, occ = 0, ins = 0, uclk, ns, latency;
+	unsigned int i;
+
+	for (i = 0; i < nr_tor_cboxes; i++) {
+		uncore_read_counter_idx(tor_cboxes[i], TOR_OCC_CTR, &now);
+		occ += tor_delta(tor_cboxes[i], now, &tor->occ[i]);
+		uncore_read_counter_idx(tor_cboxes[i], TOR_INS_CTR, &now);
+		ins += tor_delta(tor_cboxes[i], now, &tor->ins[i]);
+	}
+
+	uncore_read_fixed(tor_ubox, &now);
+	uclk = (now - tor->uclk) & ((1ULL << tor_ubox->box_type->fixed_ctr_bits) - 1);
+	tor->uclk = now;
+
+	now = ktime_get_ns();
+	ns = now - tor->ns;
+	tor->ns = now;
+
+	if (ins < TOR_MIN_INSERTS || !uclk)
+		return;
+
+	/* cycles = occ / ins, ns = cycles * ns / uclk, 4 bits of fraction */
+	latency = div64_u64(div64_u64(occ << 4, ins) * ns, uclk) >> 4;
+	if (!ctx->idle_read_ns)
+		WRITE_ONCE(ctx->idle_read_ns, latency);
+
+	/* Smooth it a bit, one epoch is noisy */
+	if (ctx->measured_read_ns)
+		latency = (3 * ctx->measured_read_ns + latency) / 4;
+	WRITE_ONCE(ctx->measured_read_ns, latency);
+}
+
+/**
+ * emulate_nvm_tor_correct
+ * @ctx:	the context of this cpu
+ * @params:	snapshot of the parameters of this epoch
+ *
+ * Move DRAM latency of this epoch by how far the measured one drifted from
+ * idle, if there is a measurement. The first emulated cpu of @ctx takes the
+ * measurement first.
+ */
+void emulate_nvm_tor_correct(struct emulate_nvm_ctx *ctx,
+			     struct emulate_nvm_params *params)
+{
+	u64 measured, idle;
+
+	if (smp_processor_id() == ctx->cpu)
+		emulate_nvm_tor_epoch(ctx);
+
+	measured = READ_ONCE(ctx->measured_read_ns);
+	idle = READ_ONCE(ctx->idle_read_ns);
+	if (!measured || !idle)
+		return;
+
+	if (measured >= idle)
+		params->dram_read_ns += measured - idle;
+	else
+		params->dram_read_ns -= min(params->dram_read_ns, idle - measured);
+
+	if (params->nvm_read_ns > params->dram_read_ns)
+		params->read_delta_ns = params->nvm_read_ns - params->dram_read_ns;
+	else
+		params->read_delta_ns = 0;
+}
+
+static void __emulate_nvm_tor_setup(void *info)
+{
+	struct emulate_nvm_ctx *ctx = info;
+	struct emulate_nvm_tor *tor = ctx_to_tor(ctx);
+	unsigned int i;
+
+	for (i = 0; i < nr_tor_cboxes; i++) {
+		uncore_disable_box(tor_cboxes[i]);
+		uncore_enable_event_idx(tor_cboxes[i], TOR_OCC_CTR,
+			&cbox_tor_occupancy_miss_remote);
+		uncore_enable_event_idx(tor_cboxes[i], TOR_INS_CTR,
+			&cbox_tor_inserts_miss_remote);
+		uncore_read_counter_idx(tor_cboxes[i], TOR_OCC_CTR, &tor->occ[i]);
+		uncore_read_counter_idx(tor_cboxes[i], TOR_INS_CTR, &tor->ins[i]);
+		uncore_enable_box(tor_cboxes[i]);
+	}
+
+	uncore_enable_fixed(tor_ubox, true);
+	uncore_read_fixed(tor_ubox, &tor->uclk);
+	tor->ns = ktime_get_ns();
+}
+
+static void __emulate_nvm_tor_idle(void *info)
+{
+	emulate_nvm_tor_epoch(info);
+}
+
+static void __emulate_nvm_tor_clear(void *info)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr_tor_cboxes; i++) {
+		uncore_disable_event_idx(tor_cboxes[i], TOR_OCC_CTR,
+			&cbox_tor_occupancy_miss_remote);
+		uncore_disable_event_idx(tor_cboxes[i], TOR_INS_CTR,
+			&cbox_tor_inserts_miss_remote);
+	}
+	uncore_enable_fixed(tor_ubox, false);
+}
+
+/**
+ * emulate_nvm_tor_init
+ * Return:	Non-zero on failure
+ *
+ * Program TOR occupancy and inserts on all C-Boxes of every emulated socket.
+ * Call it after C-Box attribution is set up, which resets the boxes.
+ */
+int emulate_nvm_tor_init(void)
+{
+	struct emulate_nvm_ctx *ctx;
+
+	nr_tor_cboxes = emulate_nvm_cbox_collect(tor_cboxes, TOR_MAX_BOXES);
+	tor_ubox = uncore_get_first_box(uncore_msr_type[UNCORE_MSR_UBOX_ID], 0);
+	if (!nr_tor_cboxes || !tor_ubox) {
+		pr_err("No C-Box or U-Box for closed loop");
+		return -ENXIO;
+	}
+
+	for_each_emulate_nvm_ctx(ctx) {
+		ctx->measured_read_ns = 0;
+		ctx->idle_read_ns = 0;
+		smp_call_function_single(ctx->cpu, __emulate_nvm_tor_setup, ctx, 1);
+	}
+
+	/* Nothing is delayed yet, this is the idle baseline */
+	msleep(TOR_IDLE_MS);
+	for_each_emulate_nvm_ctx(ctx) {
+		smp_call_function_single(ctx->cpu, __emulate_nvm_tor_idle, ctx, 1);
+		pr_info("Closed loop: Node %d, idle TOR latency %llu ns", ctx->node,
+			ctx->idle_read_ns);
+	}
+
+	pr_info("Closed loop: TOR occupancy on %u C-Boxes", nr_tor_cboxes);
+	return 0;
+}
+
+void emulate_nvm_tor_exit(void)
+{
+	struct emulate_nvm_ctx *ctx;
+
+	if (!nr_tor_cboxes || !tor_ubox)
+		return;
+
+	for_each_emulate_nvm_ctx(ctx)
+		smp_call_function_single(ctx->cpu, __emulate_nvm_tor_clear, NULL, 1);
+	nr_tor_cboxes = 0;
+}
@@ -0,0 +1,101 @@
+/*
+ *	Copyright (C) 2015-2016 Yizhou Shan <shanyizhou@ict.ac.cn>
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; either version 2 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License along
+ *	with this program; if not, write to the Free Software Foundation, Inc.,
+ *	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * On-DIMM write-combining buffer. Persistent memory DIMMs put a small buffer
+ * in front of the media, sequential and repeated writes are merged there and
+ * only cost the buffer latency. Charging nvm_write_ns to every write makes
+ * log-structured writers look much worse than they are.
+ *
+ * Whether writes hit the buffer is estimated from the DRAM of NVM node:
+ * a WR_CAS without an ACT went to an open row, i.e. near a recent write.
+ *
+ *   hits = WR_CAS - ACT.WR
+ *
+ * The buffer absorbs bursts up to its capacity on every channel, plus what it
+ * drains at media write bandwidth during the epoch. Absorbed writes pay
+ * wcb_hit_ns instead of nvm_write_ns. Capacity and hit latency come from the
+ * device profile, a profile without a buffer (or no profile) changes nothing.
+ */
+
+#define pr_fmt(fmt) "EMULATE NVM: " fmt
+
+#include "emulate_nvm.h"
+
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+
+bool write_buffer = false;
+module_param(write_buffer, bool, 0444);
+MODULE_PARM_DESC(write_buffer, "Credit writes absorbed by the on-DIMM write-combining buffer of the profile (default: false)");
+
+/**
+ * emulate_nvm_wcb_epoch
+ * @ctx:	the context, on its first emulated cpu
+ * @wr:		WR_CAS of NVM node in this epoch
+ * @act_wr:	ACT.WR of NVM node in this epoch
+ * @channels:	IMC channels of NVM node
+ * @ns:		length of this epoch
+ */
+void emulate_nvm_wcb_epoch(struct emulate_nvm_ctx *ctx, u64 wr, u64 act_wr,
+			   unsigned int channels, u64 ns)
+{
+	u64 hits, room, absorbed;
+	unsigned int bytes;
+
+	bytes = READ_ONCE(ctx->wcb_bytes);
+	if (!bytes || !wr) {
+		WRITE_ONCE(ctx->wcb_hit_pct, 0);
+		return;
+	}
+
+	hits = wr > act_wr ? wr - act_wr : 0;
+
+	/* One full buffer per channel, plus what drains meanwhile (B/us * ns) */
+	room = (u64)bytes / 64 * channels +
+		div_u64(READ_ONCE(ctx->write_bw_mbps) * ns, 64 * 1000);
+	absorbed = min(hits, room);
+
+	WRITE_ONCE(ctx->wcb_hit_pct, div64_u64(absorbed * 100, wr));
+}
+
+/**
+ * emulate_nvm_wcb_correct
+ * @ctx:	the context of this cpu
+ * @params:	snapshot of the parameters of this epoch
+ *
+ * Blend the write delta of buffer hits into the one of media writes.
+ */
+void emulate_nvm_wcb_correct(struct emulate_nvm_ctx *ctx,
+			     struct emulate_nvm_params *params)
+{
+	unsigned int hit_pct = READ_ONCE(ctx->wcb_hit_pct);
+	u64 hit_ns = READ_ONCE(ctx->wcb_hit_ns), hit_delta_ns = 0;
+
+	if (!hit_pct)
+		return;
+
+	if (hit_ns > params->dram_write_ns)
+		hit_delta_ns = hit_ns - params->dram_write_ns;
+	hit_delta_ns = min(hit_delta_ns, params->write_delta_ns);
+
+	params->write_delta_ns = div_u64(params->write_delta_ns * (100 - hit_pct) +
+					 hit_delta_ns * hit_pct, 100);
+}
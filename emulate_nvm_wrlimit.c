@@ -0,0 +1,84 @@
+/*
+ *	Copyright (C) 2015-2016 Yizhou Shan <shanyizhou@ict.ac.cn>
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; either version 2 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License along
+ *	with this program; if not, write to the Free Software Foundation, Inc.,
+ *	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Write bandwidth limiter. THRT_PWR caps reads and writes of a channel
+ * together, while NVM writes are several times slower than its reads. The
+ * IMC throttle is left to the read bandwidth, and writes beyond write_bw_mbps
+ * are slowed down in software, on the cpus that issue them.
+ *
+ * Every epoch, the bytes written to NVM node (WR_CAS) are compared with what
+ * write_bw_mbps allows in that time. The excess would take this much longer
+ * to drain at write bandwidth:
+ *
+ *   excess_ns = (bytes - budget) / write_bw
+ *
+ * Writers run in parallel, so each of them has to wait about that long. It is
+ * spread over the writes of an average emulated cpu, and added to the write
+ * delta of the next epochs:
+ *
+ *   limit_ns += excess_ns * nr_cpus / WR_CAS
+ *
+ * It only grows while over budget, and halves every epoch under it, so it
+ * settles around the write bandwidth instead of flipping on and off.
+ *
+ * Write amplification is left out on purpose. With write_amp on, every write
+ * already pays for its extra media bytes at write bandwidth (wa_write_ns),
+ * counting them here too would charge them twice.
+ */
+
+#define pr_fmt(fmt) "EMULATE NVM: " fmt
+
+#include "emulate_nvm.h"
+
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/cpumask.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+
+bool write_limit = false;
+module_param(write_limit, bool, 0444);
+MODULE_PARM_DESC(write_limit, "Delay writers when writes to NVM node exceed its write bandwidth (default: false)");
+
+/* No single write waits longer than this, whatever the counts say */
+#define WRLIMIT_MAX_NS			100000
+
+/**
+ * emulate_nvm_wrlimit_epoch
+ * @ctx:	the context, on its first emulated cpu
+ * @wr:		WR_CAS of NVM node in this epoch
+ * @wr_mbps:	write bandwidth of NVM node in this epoch
+ * @ns:		length of this epoch
+ */
+void emulate_nvm_wrlimit_epoch(struct emulate_nvm_ctx *ctx, u64 wr,
+			       u64 wr_mbps, u64 ns)
+{
+	unsigned long write_bw_mbps = READ_ONCE(ctx->write_bw_mbps);
+	u64 limit_ns = READ_ONCE(ctx->wr_limit_ns), excess_ns;
+
+	if (!write_bw_mbps || !wr || wr_mbps <= write_bw_mbps) {
+		WRITE_ONCE(ctx->wr_limit_ns, limit_ns / 2);
+		return;
+	}
+
+	excess_ns = div64_u64((wr_mbps - write_bw_mbps) * ns, write_bw_mbps);
+	limit_ns += div64_u64(excess_ns * cpumask_weight(&ctx->cpus), wr);
+
+	WRITE_ONCE(ctx->wr_limit_ns, min_t(u64, limit_ns, WRLIMIT_MAX_NS));
+}
@@ -0,0 +1,71 @@
+#!/bin/bash
+#
+# Copyright (C) 2015-2016 Yizhou Shan <shanyizhou@ict.ac.cn>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+#
+# Per-epoch overhead of self-hosted injection vs the IPI path.
+#
+# Both runs use HA attribution, the only one with an IPI path, and a fixed
+# epoch, so they take the same number of epochs. The overhead is what each
+# epoch costs minus the delay it injects on purpose, in TSC cycles:
+#
+#   self-hosted:	hrtimer of the emulated cpu, start to end
+#   IPI:		hrtimer of the polling cpu, through the synchronous
+#			IPI to the emulated cpu and back
+#
+# /proc/emulate_nvm has it per emulated cpu, as "epoch overhead". Run a
+# memory-bound load on the emulated cpu meanwhile, or the HA box counts
+# next to nothing and there is little to inject.
+#
+# Usage: epoch_overhead.sh [nvm_node] [seconds]
+#
+
+set -e
+
+_PREFIX=/home/syz/Github/NVM
+
+CORE_PMU_MODULE=${_PREFIX}/core.ko
+UNCORE_PMU_MODULE=${_PREFIX}/uncore.ko
+
+EMULATE_IOCTL=/proc/emulate_nvm
+
+INSTALL_MOD=insmod
+REMOVE_MOD=rmmod
+
+NVM_NODE=${1:-1}
+SECONDS_PER_RUN=${2:-10}
+
+# 10ms epochs, 100 per second
+EPOCH_NS=10000000
+
+Run()
+{
+	${INSTALL_MOD} ${CORE_PMU_MODULE}
+	${INSTALL_MOD} ${UNCORE_PMU_MODULE} nvm_node=${NVM_NODE} \
+		attribution=ha adaptive_epoch=0 max_epoch_ns=${EPOCH_NS} \
+		self_hosted=$1
+
+	sleep ${SECONDS_PER_RUN}
+	echo "self_hosted=$1:"
+	grep -E "^CPU|epoch overhead" ${EMULATE_IOCTL}
+
+	${REMOVE_MOD} ${UNCORE_PMU_MODULE}
+	${REMOVE_MOD} ${CORE_PMU_MODULE}
+}
+
+Run 1
+Run 0
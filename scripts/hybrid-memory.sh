@@ -1,8 +1,11 @@
 #!/bin/bash
 
+coremod=/home/syz/Github/NVM/core.ko
 modname=/home/syz/Github/NVM/uncore.ko
 
-numactl --physcpubind=6 --membind=1 insmod $modname
+# uncore.ko uses core.ko to count memory stalls
+insmod $coremod
+numactl --physcpubind=6 --membind=1 insmod $modname nvm_node=1 polling_cpu=6
 
 for ((bw = 0; bw <= 4; bw += 2)); do
 	echo $bw > /proc/uncore_pmu
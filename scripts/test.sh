@@ -37,8 +37,8 @@ Start()
 
 End()
 {
-	${REMOVE_MOD} ${CORE_PMU_MODULE}
 	${REMOVE_MOD} ${UNCORE_PMU_MODULE}
+	${REMOVE_MOD} ${CORE_PMU_MODULE}
 }
 
 declare -i bw
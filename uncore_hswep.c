@@ -91,6 +91,12 @@
 #define HSWEP_MSR_PMON_GLOBAL_STATUS	0x701
 #define HSWEP_MSR_PMON_GLOBAL_CONFIG	0x702
 
+/* HSWEP Global Control Register Bit Layout */
+#define HSWEP_GLOBAL_CTL_PMI_CORE_SEL	0x0003FFFF	/* Cores receiving PMI, one bit each */
+#define HSWEP_GLOBAL_CTL_UNFRZ_ALL	(1ULL << 29)	/* Un-Freeze all boxes */
+#define HSWEP_GLOBAL_CTL_WK_ON_PMI	(1ULL << 30)	/* Wake up sleeping cores on PMI */
+#define HSWEP_GLOBAL_CTL_FRZ_ALL	(1ULL << 31)	/* Freeze all boxes */
+
 /* HSWEP Uncore U-box */
 #define HSWEP_MSR_U_PMON_BOX_STATUS	0x708
 #define HSWEP_MSR_U_PMON_UCLK_FIXED_CTL	0x703
@@ -221,29 +227,96 @@ static void hswep_uncore_msr_disable_box(struct uncore_box *box)
 	}
 }
 
+static void hswep_uncore_msr_enable_event_idx(struct uncore_box *box,
+					      unsigned int idx,
+					      struct uncore_event *event)
+{
+	wrmsrl(uncore_msr_perf_ctl_idx(box, idx), event->enable);
+}
+
+static void hswep_uncore_msr_disable_event_idx(struct uncore_box *box,
+					       unsigned int idx,
+					       struct uncore_event *event)
+{
+	wrmsrl(uncore_msr_perf_ctl_idx(box, idx), event->disable);
+}
+
+static void hswep_uncore_msr_write_counter_idx(struct uncore_box *box,
+					       unsigned int idx, u64 value)
+{
+	wrmsrl(uncore_msr_perf_ctr_idx(box, idx), value & uncore_box_ctr_mask(box));
+}
+
+static void hswep_uncore_msr_read_counter_idx(struct uncore_box *box,
+					      unsigned int idx, u64 *value)
+{
+	u64 tmp;
+
+	rdmsrl(uncore_msr_perf_ctr_idx(box, idx), tmp);
+	*value = tmp & uncore_box_ctr_mask(box);
+}
+
 static void hswep_uncore_msr_enable_event(struct uncore_box *box,
 					  struct uncore_event *event)
 {
-	wrmsrl(uncore_msr_perf_ctl(box), event->disable);
+	hswep_uncore_msr_enable_event_idx(box, 0, event);
 }
 
 static void hswep_uncore_msr_disable_event(struct uncore_box *box,
 					   struct uncore_event *event)
 {
-	wrmsrl(uncore_msr_perf_ctl(box), event->enable);
+	hswep_uncore_msr_disable_event_idx(box, 0, event);
 }
 
 static void hswep_uncore_msr_write_counter(struct uncore_box *box, u64 value)
 {
-	wrmsrl(uncore_msr_perf_ctr(box), value & uncore_box_ctr_mask(box));
+	hswep_uncore_msr_write_counter_idx(box, 0, value);
 }
 
 static void hswep_uncore_msr_read_counter(struct uncore_box *box, u64 *value)
+{
+	hswep_uncore_msr_read_counter_idx(box, 0, value);
+}
+
+static void hswep_uncore_msr_enable_fixed(struct uncore_box *box, bool enable)
+{
+	wrmsrl(box->box_type->fixed_ctl, enable ? HSWEP_MSR_EVNTSEL_EN : 0);
+}
+
+static void hswep_uncore_msr_read_fixed(struct uncore_box *box, u64 *value)
 {
 	u64 tmp;
 
-	rdmsrl(uncore_msr_perf_ctr(box), tmp);
-	*value = tmp & uncore_box_ctr_mask(box);
+	rdmsrl(box->box_type->fixed_ctr, tmp);
+	*value = tmp & ((1ULL << box->box_type->fixed_ctr_bits) - 1);
+}
+
+/*
+ * Filter0 and filter1 are shared by all counters of a box. The low 32 bits of
+ * @value go to filter0, the high 32 bits go to filter1 (if the box has one).
+ * For C-Box, filter0 holds TID/LINK/STATE, filter1 holds NID/OPC.
+ */
+static void hswep_uncore_msr_write_filter(struct uncore_box *box, u64 value)
+{
+	if (box->box_type->box_filter0)
+		wrmsrl(uncore_msr_box_filter(box), value & 0xFFFFFFFF);
+	if (box->box_type->box_filter1)
+		wrmsrl(uncore_msr_box_filter1(box), value >> 32);
+}
+
+static void hswep_uncore_msr_read_filter(struct uncore_box *box, u64 *value)
+{
+	u64 tmp;
+
+	*value = 0;
+	if (box->box_type->box_filter0) {
+		rdmsrl(uncore_msr_box_filter(box), tmp);
+		*value |= tmp & 0xFFFFFFFF;
+	}
+	if (box->box_type->box_filter1) {
+		rdmsrl(uncore_msr_box_filter1(box), tmp);
+		*value |= tmp << 32;
+	}
 }
 
 /*
@@ -264,7 +337,15 @@ static void hswep_uncore_msr_read_counter(struct uncore_box *box, u64 *value)
 	.enable_event	= hswep_uncore_msr_enable_event,	\
 	.disable_event	= hswep_uncore_msr_disable_event,	\
 	.write_counter	= hswep_uncore_msr_write_counter,	\
-	.read_counter	= hswep_uncore_msr_read_counter
+	.read_counter	= hswep_uncore_msr_read_counter,	\
+	.write_filter	= hswep_uncore_msr_write_filter,	\
+	.read_filter	= hswep_uncore_msr_read_filter,		\
+	.enable_fixed	= hswep_uncore_msr_enable_fixed,	\
+	.read_fixed	= hswep_uncore_msr_read_fixed,		\
+	.enable_event_idx  = hswep_uncore_msr_enable_event_idx,	\
+	.disable_event_idx = hswep_uncore_msr_disable_event_idx,\
+	.write_counter_idx = hswep_uncore_msr_write_counter_idx,\
+	.read_counter_idx  = hswep_uncore_msr_read_counter_idx
 
 const struct uncore_box_ops HSWEP_UNCORE_UBOX_OPS = {
 	HSWEP_UNCORE_MSR_BOX_OPS()
@@ -435,44 +516,99 @@ static void hswep_uncore_pci_disable_box(struct uncore_box *box)
 	}
 }
 
-static void hswep_uncore_pci_enable_event(struct uncore_box *box,
-					  struct uncore_event *event)
+static void hswep_uncore_pci_enable_event_idx(struct uncore_box *box,
+					      unsigned int idx,
+					      struct uncore_event *event)
 {
 	pci_write_config_dword(box->pdev,
-			       uncore_pci_perf_ctl(box),
+			       uncore_pci_perf_ctl_idx(box, idx),
 			       event->enable);
 }
 
-static void hswep_uncore_pci_disable_event(struct uncore_box *box,
-					   struct uncore_event *event)
+static void hswep_uncore_pci_disable_event_idx(struct uncore_box *box,
+					       unsigned int idx,
+					       struct uncore_event *event)
 {
 	pci_write_config_dword(box->pdev,
-			       uncore_pci_perf_ctl(box),
+			       uncore_pci_perf_ctl_idx(box, idx),
 			       event->disable);
 }
 
-static void hswep_uncore_pci_write_counter(struct uncore_box *box, u64 value)
+static void hswep_uncore_pci_write_counter_idx(struct uncore_box *box,
+					       unsigned int idx, u64 value)
 {
 	u32 low, high;
 
 	low = (u32)(value & 0xffffffff);
 	high = (u32)((value & uncore_box_ctr_mask(box)) >> 32);
 
-	pci_write_config_dword(box->pdev, uncore_pci_perf_ctr(box), low);
-	pci_write_config_dword(box->pdev, uncore_pci_perf_ctr(box)+4, high);
+	pci_write_config_dword(box->pdev, uncore_pci_perf_ctr_idx(box, idx), low);
+	pci_write_config_dword(box->pdev, uncore_pci_perf_ctr_idx(box, idx)+4, high);
 }
 
-static void hswep_uncore_pci_read_counter(struct uncore_box *box, u64 *value)
+static void hswep_uncore_pci_read_counter_idx(struct uncore_box *box,
+					      unsigned int idx, u64 *value)
 {
 	unsigned int low, high;
 
-	pci_read_config_dword(box->pdev, uncore_pci_perf_ctr(box), &low);
-	pci_read_config_dword(box->pdev, uncore_pci_perf_ctr(box)+4, &high);
+	pci_read_config_dword(box->pdev, uncore_pci_perf_ctr_idx(box, idx), &low);
+	pci_read_config_dword(box->pdev, uncore_pci_perf_ctr_idx(box, idx)+4, &high);
 
 	*value = ((u64)high << 32) | (u64)low;
 	*value &= uncore_box_ctr_mask(box);
 }
 
+static u64 hswep_uncore_pci_ack_box(struct uncore_box *box)
+{
+	unsigned int status = 0;
+
+	/* Write '1' will clear overflow bit */
+	pci_read_config_dword(box->pdev, uncore_pci_box_status(box), &status);
+	if (status)
+		pci_write_config_dword(box->pdev, uncore_pci_box_status(box), status);
+
+	return status;
+}
+
+static void hswep_uncore_pci_enable_fixed(struct uncore_box *box, bool enable)
+{
+	pci_write_config_dword(box->pdev, box->box_type->fixed_ctl,
+			       enable ? HSWEP_PCI_EVNTSEL_EN : 0);
+}
+
+static void hswep_uncore_pci_read_fixed(struct uncore_box *box, u64 *value)
+{
+	unsigned int low, high;
+
+	pci_read_config_dword(box->pdev, box->box_type->fixed_ctr, &low);
+	pci_read_config_dword(box->pdev, box->box_type->fixed_ctr+4, &high);
+
+	*value = ((u64)high << 32) | (u64)low;
+	*value &= (1ULL << box->box_type->fixed_ctr_bits) - 1;
+}
+
+static void hswep_uncore_pci_enable_event(struct uncore_box *box,
+					  struct uncore_event *event)
+{
+	hswep_uncore_pci_enable_event_idx(box, 0, event);
+}
+
+static void hswep_uncore_pci_disable_event(struct uncore_box *box,
+					   struct uncore_event *event)
+{
+	hswep_uncore_pci_disable_event_idx(box, 0, event);
+}
+
+static void hswep_uncore_pci_write_counter(struct uncore_box *box, u64 value)
+{
+	hswep_uncore_pci_write_counter_idx(box, 0, value);
+}
+
+static void hswep_uncore_pci_read_counter(struct uncore_box *box, u64 *value)
+{
+	hswep_uncore_pci_read_counter_idx(box, 0, value);
+}
+
 #define HSWEP_UNCORE_PCI_BOX_OPS()				\
 	.show_box	= hswep_uncore_pci_show_box,		\
 	.init_box	= hswep_uncore_pci_init_box,		\
@@ -482,7 +618,14 @@ static void hswep_uncore_pci_read_counter(struct uncore_box *box, u64 *value)
 	.enable_event	= hswep_uncore_pci_enable_event,	\
 	.disable_event	= hswep_uncore_pci_disable_event,	\
 	.write_counter	= hswep_uncore_pci_write_counter,	\
-	.read_counter	= hswep_uncore_pci_read_counter
+	.read_counter	= hswep_uncore_pci_read_counter,	\
+	.ack_box	= hswep_uncore_pci_ack_box,		\
+	.enable_fixed	= hswep_uncore_pci_enable_fixed,	\
+	.read_fixed	= hswep_uncore_pci_read_fixed,		\
+	.enable_event_idx  = hswep_uncore_pci_enable_event_idx,	\
+	.disable_event_idx = hswep_uncore_pci_disable_event_idx,\
+	.write_counter_idx = hswep_uncore_pci_write_counter_idx,\
+	.read_counter_idx  = hswep_uncore_pci_read_counter_idx
 
 const struct uncore_box_ops HSWEP_UNCORE_HABOX_OPS = {
 	HSWEP_UNCORE_PCI_BOX_OPS()
@@ -728,6 +871,17 @@ static int hswep_pcibus_to_nodeid(int devid)
 	return err? pcibios_err_to_errno(err) : 0;
 }
 
+static u64 hswep_uncore_global_pmi_ctl(unsigned int core)
+{
+	/* 18 cores at most, one select bit each, in dense core order */
+	if (core >= 18)
+		return 0;
+
+	return ((1ULL << core) & HSWEP_GLOBAL_CTL_PMI_CORE_SEL) |
+	       HSWEP_GLOBAL_CTL_UNFRZ_ALL |
+	       HSWEP_GLOBAL_CTL_WK_ON_PMI;
+}
+
 int hswep_cpu_init(void)
 {
 	if (HSWEP_UNCORE_CBOX.num_boxes > boot_cpu_data.x86_max_cores)
@@ -741,6 +895,7 @@ int hswep_cpu_init(void)
 	uncore_pmu.global_ctl		= HSWEP_MSR_PMON_GLOBAL_CTL;
 	uncore_pmu.global_status	= HSWEP_MSR_PMON_GLOBAL_STATUS;
 	uncore_pmu.global_config	= HSWEP_MSR_PMON_GLOBAL_CONFIG;
+	uncore_pmu.global_pmi_ctl	= hswep_uncore_global_pmi_ctl;
 
 	return 0;
 }
@@ -882,6 +1037,113 @@ struct uncore_event ha_imc_writes_partial = {
 	.desc = "HA to IMC partial-line Non-ISOCH write"
 };
 
+/*
+ * C-Box Events:	TOR_INSERTS
+ * Event Code: 0x35
+ * Max. Inc/Cyc: 1
+ * Register Restrictions: 0-3
+ *
+ * Counts the number of entries successfuly inserted into the TOR that match
+ * qualifications specified by the subevent. Each C-Box only sees requests
+ * hashed to its own LLC slice.
+ */
+
+/*
+ * MISS_REMOTE_OPCODE: Miss transactions inserted into the TOR that match an
+ * opcode (C-Box filter1 OPC) and target remote memory. With TID_EN, only the
+ * thread selected by C-Box filter0 TID is counted.
+ */
+struct uncore_event cbox_tor_inserts_miss_remote_opcode = {
+	.enable = HSWEP_MSR_EVNTSEL_EN | HSWEP_MSR_EVNTSEL_TID_EN | 0x8300 | 0x0035,
+	.disable = 0,
+	.desc = "TOR inserts of remote misses, filtered by opcode and TID"
+};
+
+/*
+ * MISS_REMOTE: All miss transactions inserted into the TOR that target remote
+ * memory. No filter applies, so all cores of this socket are counted.
+ */
+struct uncore_event cbox_tor_inserts_miss_remote = {
+	.enable = HSWEP_MSR_EVNTSEL_EN | 0x8A00 | 0x0035,
+	.disable = 0,
+	.desc = "TOR inserts of remote misses"
+};
+
+/*
+ * C-Box Events:	TOR_OCCUPANCY
+ * Event Code: 0x36
+ * Max. Inc/Cyc: 20
+ * Register Restrictions: 0
+ *
+ * For each uncore cycle, accumulates the number of valid entries in the TOR
+ * that match the subevent. Divided by TOR_INSERTS of the same subevent, it is
+ * the average time (in uncore cycles) an entry stays in the TOR, i.e. the miss
+ * latency seen from the LLC (Little's law).
+ */
+struct uncore_event cbox_tor_occupancy_miss_remote = {
+	.enable = HSWEP_MSR_EVNTSEL_EN | 0x8A00 | 0x0036,
+	.disable = 0,
+	.desc = "TOR occupancy of remote misses"
+};
+
+/*
+ * IMC Events:	CAS_COUNT
+ * Event Code: 0x04
+ * Max. Inc/Cyc: 1
+ * Register Restrictions: 0-3
+ *
+ * DRAM RD_CAS and WR_CAS commands of one channel. Each CAS moves one 64B
+ * line, so the sum over all channels of a node is its memory bandwidth. No
+ * OV_EN, nobody wants PMIs from these.
+ */
+struct uncore_event imc_cas_count_rd = {
+	.enable = (1<<22) | 0x0300 | 0x0004,
+	.disable = 0,
+	.desc = "DRAM RD_CAS commands, w/ and w/o auto-pre"
+};
+
+struct uncore_event imc_cas_count_wr = {
+	.enable = (1<<22) | 0x0C00 | 0x0004,
+	.disable = 0,
+	.desc = "DRAM WR_CAS commands, w/ and w/o auto-pre"
+};
+
+/*
+ * IMC Events:	ACT_COUNT
+ * Event Code: 0x01
+ * Max. Inc/Cyc: 1
+ * Register Restrictions: 0-3
+ *
+ * DRAM Activate commands of one channel, i.e. row buffer misses. CAS without
+ * an ACT hit a row that was open already.
+ */
+struct uncore_event imc_act_count_wr = {
+	.enable = (1<<22) | 0x0200 | 0x0001,
+	.disable = 0,
+	.desc = "DRAM Activate commands due to writes"
+};
+
+struct uncore_event imc_act_count_rd = {
+	.enable = (1<<22) | 0x0100 | 0x0001,
+	.disable = 0,
+	.desc = "DRAM Activate commands due to reads"
+};
+
+/*
+ * IMC Events:	POWER_THROTTLE_CYCLES
+ * Event Code: 0x41
+ * Max. Inc/Cyc: 1
+ * Register Restrictions: 0-3
+ *
+ * DCLK cycles in which a rank of the channel was throttled, by THRT_PWR or by
+ * temperature. One umask bit per rank, all of them are selected.
+ */
+struct uncore_event imc_power_throttle_cycles = {
+	.enable = (1<<22) | 0xFF00 | 0x0041,
+	.disable = 0,
+	.desc = "DCLK cycles with a throttled rank"
+};
+
 /******************************************************************************
  * Integrated Memory Controller (IMC) Part
  *
@@ -958,7 +1220,9 @@ __always_unused static void __test3(struct pci_dev *pdev)
  * Bit 11:0, default value after hardware reset: 0xfff
  * Seriously Yizhou, you should learn more about MC/DRAM! :(
  */
-static int hswep_imc_set_threshold(struct pci_dev *pdev, unsigned int threshold)
+#define HSWEP_IMC_THRT_PWR_MAX		0x0fff
+
+static int hswep_imc_set_raw_threshold(struct pci_dev *pdev, unsigned int raw)
 {
 	u32 offset, i;
 	u16 config;
@@ -969,24 +1233,35 @@ static int hswep_imc_set_threshold(struct pci_dev *pdev, unsigned int threshold)
 		
 		pci_read_config_word(pdev, offset, &config);
 		config &= (1 << 15);
-		
-		/* XXX Relationship???? */
-		switch (threshold) {
-			case 2: /* 1/2 */
-				config |= 0x00ff;
-				break;
-			case 4: /* 1/4 */
-				config |= 0x007f;
-				break;
-			default:
-				config |= 0x0fff;
-		}
+		config |= raw & HSWEP_IMC_THRT_PWR_MAX;
 		pci_write_config_word(pdev, offset, config);
 	}
 
 	return 0;
 }
 
+/*
+ * XXX Relationship????
+ * Measured once on one machine, calibrate for anything else,
+ * see emulate_nvm_calibrate.c.
+ */
+static unsigned int hswep_imc_threshold_to_raw(unsigned int threshold)
+{
+	switch (threshold) {
+		case 2: /* 1/2 */
+			return 0x00ff;
+		case 4: /* 1/4 */
+			return 0x007f;
+		default:
+			return HSWEP_IMC_THRT_PWR_MAX;
+	}
+}
+
+static int hswep_imc_set_threshold(struct pci_dev *pdev, unsigned int threshold)
+{
+	return hswep_imc_set_raw_threshold(pdev, hswep_imc_threshold_to_raw(threshold));
+}
+
 /*
  * Use [thrt_pwr_dimm_[0:2]].THRT_PER_EN bit to enable throttling
  * Bit 15:15, default value after hardware reset: 0x1 (Enable)
@@ -1022,8 +1297,11 @@ static void hswep_imc_disable_throttle(struct pci_dev *pdev)
 
 static const struct uncore_imc_ops HSWEP_E5_IMC_OPS = {
 	.set_threshold		= hswep_imc_set_threshold,
+	.threshold_to_raw	= hswep_imc_threshold_to_raw,
+	.set_raw_threshold	= hswep_imc_set_raw_threshold,
 	.enable_throttle	= hswep_imc_enable_throttle,
-	.disable_throttle	= hswep_imc_disable_throttle
+	.disable_throttle	= hswep_imc_disable_throttle,
+	.raw_threshold_max	= HSWEP_IMC_THRT_PWR_MAX
 };
 
 int hswep_imc_init(void)
@@ -37,6 +37,9 @@ const struct pci_device_id *uncore_imc_device_ids;
 const struct uncore_imc_ops *uncore_imc_ops;
 LIST_HEAD(uncore_imc_devices);
 
+/* Per-node calibration, nr == 0 means not calibrated */
+static struct uncore_imc_bw_table uncore_imc_bw_tables[UNCORE_MAX_SOCKET];
+
 void uncore_imc_exit(void)
 {
 	struct list_head *head;
@@ -76,6 +79,8 @@ static int __must_check uncore_imc_new_device(struct pci_dev *pdev)
 		"Invalid Node ID: %d, check pci-node mapping", nodeid);
 
 	imc->nodeid = nodeid;
+	imc->channel = uncore_imc_nr_channels(nodeid);
+	imc->threshold = 1;
 	imc->pdev = pdev;
 	imc->ops = uncore_imc_ops;
 	list_add_tail(&imc->next, &uncore_imc_devices);
@@ -108,6 +113,7 @@ int __must_check uncore_imc_init(void)
 	/* IMC part need all low-level CPU-specific methods. */
 	if (!uncore_imc_ops			||
 	    !uncore_imc_ops->set_threshold	||
+	    !uncore_imc_ops->set_raw_threshold	||
 	    !uncore_imc_ops->enable_throttle	||
 	    !uncore_imc_ops->disable_throttle)
 		return -EINVAL;
@@ -148,6 +154,22 @@ out:
  * The biggest @threshold depends on specific CPU.
  */
 int uncore_imc_set_threshold(unsigned int nodeid, unsigned int threshold)
+{
+	return uncore_imc_set_channel_threshold(nodeid, UNCORE_IMC_ALL_CHANNELS,
+						threshold);
+}
+
+/**
+ * uncore_imc_set_channel_threshold
+ * @nodeid:	NUMA node to set threshold
+ * @channel:	channel of @nodeid, or UNCORE_IMC_ALL_CHANNELS
+ * @threshold:	1/(threshold) to throttle memory bandwidth
+ * Return:	0 on success
+ *
+ * Other channels, and other nodes, keep their own threshold.
+ */
+int uncore_imc_set_channel_threshold(unsigned int nodeid, unsigned int channel,
+				     unsigned int threshold)
 {
 	struct uncore_imc *imc;
 	int ret = -ENXIO;
@@ -156,15 +178,224 @@ int uncore_imc_set_threshold(unsigned int nodeid, unsigned int threshold)
 		return -EINVAL;
 
 	list_for_each_entry(imc, &uncore_imc_devices, next) {
-		if (imc->nodeid == nodeid) {
-			ret = imc->ops->set_threshold(imc->pdev, threshold);
-			if (ret)
-				break;
+		if (imc->nodeid != nodeid)
+			continue;
+		if (channel != UNCORE_IMC_ALL_CHANNELS && imc->channel != channel)
+			continue;
+
+		ret = imc->ops->set_threshold(imc->pdev, threshold);
+		if (ret)
+			break;
+		imc->threshold = threshold;
+		imc->raw = 0;
+	}
+	return ret;
+}
+
+/* Number of channels, i.e. IMC devices, of @nodeid */
+unsigned int uncore_imc_nr_channels(unsigned int nodeid)
+{
+	struct uncore_imc *imc;
+	unsigned int nr = 0;
+
+	list_for_each_entry(imc, &uncore_imc_devices, next) {
+		if (imc->nodeid == nodeid)
+			nr++;
+	}
+	return nr;
+}
+
+/**
+ * uncore_imc_bw_to_threshold
+ * @peak_mbps:	bandwidth of the node when not throttled
+ * @mbps:	bandwidth wanted
+ * Return:	the threshold whose bandwidth is closest to @mbps
+ *
+ * Only 1, 2 and 4 are known to work, see hswep_imc_set_threshold().
+ */
+unsigned int uncore_imc_bw_to_threshold(unsigned long peak_mbps, unsigned long mbps)
+{
+	static const unsigned int thresholds[] = { 1, 2, 4 };
+	unsigned long diff, best_diff = ULONG_MAX;
+	unsigned int i, best = 1;
+
+	if (!mbps)
+		return 1;
+
+	for (i = 0; i < ARRAY_SIZE(thresholds); i++) {
+		diff = abs((long)(peak_mbps / thresholds[i]) - (long)mbps);
+		if (diff < best_diff) {
+			best_diff = diff;
+			best = thresholds[i];
 		}
 	}
+	return best;
+}
+
+/**
+ * uncore_imc_set_raw_threshold
+ * @nodeid:	NUMA node to set threshold
+ * @raw:	value of the throttle register field, 1 to raw_threshold_max
+ * Return:	0 on success
+ *
+ * Unlike uncore_imc_set_threshold(), nothing is known about the bandwidth
+ * @raw gives, unless @nodeid is calibrated, see uncore_imc_set_bw_table().
+ */
+int uncore_imc_set_raw_threshold(unsigned int nodeid, unsigned int raw)
+{
+	return uncore_imc_set_channel_raw_threshold(nodeid,
+		UNCORE_IMC_ALL_CHANNELS, raw);
+}
+
+/**
+ * uncore_imc_set_channel_raw_threshold
+ * @nodeid:	NUMA node to set threshold
+ * @channel:	channel of @nodeid, or UNCORE_IMC_ALL_CHANNELS
+ * @raw:	value of the throttle register field, 1 to raw_threshold_max
+ * Return:	0 on success
+ */
+int uncore_imc_set_channel_raw_threshold(unsigned int nodeid, unsigned int channel,
+					 unsigned int raw)
+{
+	struct uncore_imc *imc;
+	int ret = -ENXIO;
+
+	if (nodeid >= UNCORE_MAX_SOCKET)
+		return -EINVAL;
+	if (!raw || raw > uncore_imc_ops->raw_threshold_max)
+		return -EINVAL;
+
+	list_for_each_entry(imc, &uncore_imc_devices, next) {
+		if (imc->nodeid != nodeid)
+			continue;
+		if (channel != UNCORE_IMC_ALL_CHANNELS && imc->channel != channel)
+			continue;
+
+		ret = imc->ops->set_raw_threshold(imc->pdev, raw);
+		if (ret)
+			break;
+		imc->threshold = 1;
+		imc->raw = raw;
+	}
 	return ret;
 }
 
+unsigned int uncore_imc_raw_threshold_max(void)
+{
+	return uncore_imc_ops->raw_threshold_max;
+}
+
+/**
+ * uncore_imc_threshold_to_raw
+ * @threshold:	throttle ratio, 1, 2 or 4
+ * Return:	raw threshold uncore_imc_set_threshold() writes for it, 0 if
+ *		the CPU does not tell
+ */
+unsigned int uncore_imc_threshold_to_raw(unsigned int threshold)
+{
+	if (!uncore_imc_ops->threshold_to_raw)
+		return 0;
+	return uncore_imc_ops->threshold_to_raw(threshold);
+}
+
+/**
+ * uncore_imc_set_bw_table
+ * @nodeid:	NUMA node calibrated
+ * @table:	what was measured, or NULL to forget it
+ * Return:	0 on success
+ */
+int uncore_imc_set_bw_table(unsigned int nodeid,
+			    const struct uncore_imc_bw_table *table)
+{
+	unsigned int i;
+
+	if (nodeid >= UNCORE_MAX_SOCKET)
+		return -EINVAL;
+
+	if (!table) {
+		uncore_imc_bw_tables[nodeid].nr = 0;
+		return 0;
+	}
+
+	if (!table->nr || table->nr > UNCORE_IMC_BW_POINTS)
+		return -EINVAL;
+	for (i = 0; i < table->nr; i++) {
+		if (!table->raw[i] ||
+		    table->raw[i] > uncore_imc_ops->raw_threshold_max)
+			return -EINVAL;
+		if (i && (table->raw[i] <= table->raw[i - 1] ||
+			  table->mbps[i] < table->mbps[i - 1]))
+			return -EINVAL;
+	}
+
+	uncore_imc_bw_tables[nodeid] = *table;
+	return 0;
+}
+
+/* The table of @nodeid, NULL if it is not calibrated */
+const struct uncore_imc_bw_table *uncore_imc_get_bw_table(unsigned int nodeid)
+{
+	if (nodeid >= UNCORE_MAX_SOCKET || !uncore_imc_bw_tables[nodeid].nr)
+		return NULL;
+	return &uncore_imc_bw_tables[nodeid];
+}
+
+/**
+ * uncore_imc_bw_to_raw
+ * @nodeid:	a calibrated node
+ * @mbps:	bandwidth wanted
+ * Return:	raw threshold giving @mbps, 0 if @nodeid is not calibrated
+ *
+ * Linear between the points of the table, ends clamped.
+ */
+unsigned int uncore_imc_bw_to_raw(unsigned int nodeid, unsigned long mbps)
+{
+	const struct uncore_imc_bw_table *t = uncore_imc_get_bw_table(nodeid);
+	unsigned int i;
+
+	if (!t)
+		return 0;
+
+	if (mbps <= t->mbps[0])
+		return t->raw[0];
+
+	for (i = 1; i < t->nr; i++) {
+		if (mbps > t->mbps[i])
+			continue;
+		if (t->mbps[i] == t->mbps[i - 1])
+			return t->raw[i - 1];
+		return t->raw[i - 1] + (t->raw[i] - t->raw[i - 1]) *
+			(mbps - t->mbps[i - 1]) / (t->mbps[i] - t->mbps[i - 1]);
+	}
+	return t->raw[t->nr - 1];
+}
+
+/**
+ * uncore_imc_raw_to_bw
+ * @nodeid:	a calibrated node
+ * @raw:	raw threshold
+ * Return:	bandwidth @raw gives, 0 if @nodeid is not calibrated
+ */
+unsigned long uncore_imc_raw_to_bw(unsigned int nodeid, unsigned int raw)
+{
+	const struct uncore_imc_bw_table *t = uncore_imc_get_bw_table(nodeid);
+	unsigned int i;
+
+	if (!t)
+		return 0;
+
+	if (raw <= t->raw[0])
+		return t->mbps[0];
+
+	for (i = 1; i < t->nr; i++) {
+		if (raw > t->raw[i])
+			continue;
+		return t->mbps[i - 1] + (t->mbps[i] - t->mbps[i - 1]) *
+			(raw - t->raw[i - 1]) / (t->raw[i] - t->raw[i - 1]);
+	}
+	return t->mbps[t->nr - 1];
+}
+
 /**
  * uncore_imc_disable_throttle
  * @nodeid:	NUMA node to disable throttling
@@ -268,8 +499,9 @@ void uncore_print_imc_devices(void)
 
 	pr_info("\033[34m------------------------ IMC Devices ----------------------\033[0m");
 	list_for_each_entry(imc, &uncore_imc_devices, next) {
-		pr_info("......Node %d, %x:%x:%x, %d:%d:%d, Kref = %d",
+		pr_info("......Node %d Channel %u, %x:%x:%x, %d:%d:%d, Kref = %d",
 		imc->nodeid,
+		imc->channel,
 		imc->pdev->bus->number,
 		imc->pdev->vendor,
 		imc->pdev->device,
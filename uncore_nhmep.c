@@ -34,15 +34,18 @@
  */
 
 #include <asm/nmi.h>
+#include <asm/tsc.h>
 
 #include <linux/pci.h>
 #include <linux/smp.h>
+#include <linux/atomic.h>
 #include <linux/init.h>
 #include <linux/list.h>
 #include <linux/delay.h>
 #include <linux/ktime.h>
 #include <linux/sched.h>
 #include <linux/kernel.h>
+#include <linux/math64.h>
 #include <linux/module.h>
 #include <linux/percpu.h>
 #include <linux/string.h>
@@ -666,16 +669,65 @@ static u64 DELAY_JIFFIES;
 static u64 INTERVAL_NS;
 static u64 WRITE_LATENCY_DELTA;
 
-static void uncore_pmu_delay(void *ns)
+/*
+ * Delay engine of the delayed cpu, the same as emulate_nvm_delay() of the
+ * Haswell-EP module: spin on TSC, udelay() would truncate to whole
+ * microseconds, and carry what the spin missed (or overshot) into the next
+ * epoch. Requested and achieved delay are printed at exit.
+ *
+ * The delay is handed over in PENDING_NS, the IPI does not wait, and the
+ * stack of the hrtimer is gone by the time it runs.
+ */
+struct nhm_delay_state {
+	atomic64_t	pending_ns;
+	s64		carry_ns;
+	u64		requested_ns;
+	u64		achieved_ns;
+};
+
+static DEFINE_PER_CPU(struct nhm_delay_state, DELAY_STATE);
+
+/* tsc_khz is the number of cycles per millisecond */
+static void uncore_pmu_delay(void *info)
 {
-	unsigned long usec;
-	usec = (*(unsigned long *)ns)/1000;
-	udelay(usec);
+	struct nhm_delay_state *state = this_cpu_ptr(&DELAY_STATE);
+	u64 start, cycles, achieved_ns, delay_ns;
+	s64 target_ns;
+
+	if (!tsc_khz)
+		return;
+
+	delay_ns = atomic64_xchg(&state->pending_ns, 0);
+	state->requested_ns += delay_ns;
+
+	target_ns = (s64)delay_ns + state->carry_ns;
+	if (target_ns <= 0) {
+		state->carry_ns = target_ns;
+		return;
+	}
+
+	cycles = div_u64((u64)target_ns * tsc_khz, 1000000);
+	start = uncore_rdtsc();
+	while (uncore_rdtsc() - start < cycles)
+		cpu_relax();
+	achieved_ns = div_u64((uncore_rdtsc() - start) * 1000000, tsc_khz);
+
+	state->carry_ns = target_ns - (s64)achieved_ns;
+	state->achieved_ns += achieved_ns;
 }
 
 static inline void uncore_pmu_delay_cpu(int cpu, unsigned long ns)
 {
-	smp_call_function_single(cpu, uncore_pmu_delay, &ns, 0);
+	atomic64_add(ns, &per_cpu(DELAY_STATE, cpu).pending_ns);
+	smp_call_function_single(cpu, uncore_pmu_delay, NULL, 0);
+}
+
+static void uncore_pmu_show_delay(int cpu)
+{
+	struct nhm_delay_state *state = per_cpu_ptr(&DELAY_STATE, cpu);
+
+	printk(KERN_INFO "PMU CPU%2d DELAY requested = %llu ns, achieved = %llu ns, carry = %lld ns\n",
+		cpu, state->requested_ns, state->achieved_ns, state->carry_ns);
 }
 
 static inline u64 writes_to_delay(u64 nr_writes)
@@ -815,6 +867,7 @@ static void uncore_pmu_exit(void)
 	uncore_nmi_unregister();
 	uncore_pmu_hrtimer_cancel();
 	printk(KERN_INFO "PMU DELAY_JIFFIES = %10lld\n", DELAY_JIFFIES);
+	uncore_pmu_show_delay(SURVIVOR);
 	printk(KERN_INFO "%s ON CPU %2d\n", BEYBANNER, this_cpu);
 	put_cpu();
 }
@@ -49,6 +49,7 @@
 #include <linux/module.h>
 #include <linux/hrtimer.h>
 #include <linux/cpumask.h>
+#include <linux/topology.h>
 
 /*
  * This is the top description of whole system uncore pmu resources.
@@ -315,6 +316,95 @@ void uncore_print_global_pmu(struct uncore_pmu *pmu)
 	}
 }
 
+/*
+ * Dense index of the core of @cpu in its socket: how many cores of the same
+ * package have a lower core id. topology_core_id() comes from the APIC id,
+ * which has holes on 14-18 core parts and goes above 17, while PMI_CORE_SEL
+ * has one bit per core, in order. Present cpus are walked, not online ones,
+ * so offlining cpus for emulation does not shift the index.
+ */
+static unsigned int uncore_pmu_core_index(int cpu)
+{
+	int pkg = topology_physical_package_id(cpu);
+	int core = topology_core_id(cpu);
+	unsigned int index = 0;
+	int c, prev;
+	bool seen;
+
+	for_each_present_cpu(c) {
+		if (topology_physical_package_id(c) != pkg ||
+		    topology_core_id(c) >= core)
+			continue;
+
+		/* Count each core once, at its first thread */
+		seen = false;
+		for_each_present_cpu(prev) {
+			if (prev >= c)
+				break;
+			if (topology_physical_package_id(prev) == pkg &&
+			    topology_core_id(prev) == topology_core_id(c)) {
+				seen = true;
+				break;
+			}
+		}
+		if (!seen)
+			index++;
+	}
+	return index;
+}
+
+/**
+ * uncore_pmu_enable_pmi
+ * @pmu:	the uncore_pmu in question
+ * Return:	Non-zero if PMIs can not be routed to this cpu
+ *
+ * Route overflow PMIs of all boxes in *this* socket to *this* cpu, and
+ * un-freeze them. Boxes only report overflows of counters with overflow
+ * enabled in their control registers. Must be called with preemption off.
+ */
+int uncore_pmu_enable_pmi(struct uncore_pmu *pmu)
+{
+	u64 ctl;
+
+	if (!pmu->global_ctl || !pmu->global_pmi_ctl)
+		return -EOPNOTSUPP;
+
+	ctl = pmu->global_pmi_ctl(uncore_pmu_core_index(smp_processor_id()));
+	if (!ctl)
+		return -EINVAL;
+
+	wrmsrl(pmu->global_ctl, ctl);
+	return 0;
+}
+
+/* Stop routing PMIs of *this* socket, see uncore_pmu_enable_pmi() */
+void uncore_pmu_disable_pmi(struct uncore_pmu *pmu)
+{
+	if (pmu->global_ctl)
+		wrmsrl(pmu->global_ctl, 0);
+}
+
+/**
+ * uncore_pmu_ack_pmi
+ * @pmu:	the uncore_pmu in question
+ * Return:	global status of *this* socket before clearing, 0 if no PMI
+ *
+ * Only touches MSRs, so it is safe in NMI context.
+ */
+u64 uncore_pmu_ack_pmi(struct uncore_pmu *pmu)
+{
+	u64 status;
+
+	if (!pmu->global_status)
+		return 0;
+
+	/* RW1C */
+	rdmsrl(pmu->global_status, status);
+	if (status)
+		wrmsrl(pmu->global_status, status);
+	return status;
+}
+
 /**
  * uncore_print_node_info
  *
@@ -687,11 +777,17 @@ static int uncore_init(void)
 	
 	/*
 	 * Emulation is just a client of PMU :)
+	 * A module that can not emulate what it was asked for
+	 * should not stay loaded pretending it does.
 	 */
-	start_emulate_nvm();
+	ret = start_emulate_nvm();
+	if (ret)
+		goto procerr;
 
 	return 0;
 
+procerr:
+	uncore_proc_remove();
 out:
 	uncore_imc_exit();
 cpuerr:
@@ -26,6 +26,7 @@
 
 #include <linux/pci.h>
 #include <linux/types.h>
+#include <linux/string.h>
 #include <linux/hrtimer.h>
 #include <linux/compiler.h>
 
@@ -33,6 +34,9 @@
 
 #define UNCORE_MAX_SOCKET		8
 
+/* Most counters a box of any type has */
+#define UNCORE_MAX_COUNTERS		5
+
 /* PCI Driver Data <--> Box Type and IDX */
 #define UNCORE_PCI_DEV_DATA(type, idx)	(((type) << 8) | (idx))
 #define UNCORE_PCI_DEV_TYPE(data)	(((data) >> 8) & 0xFF)
@@ -81,6 +85,8 @@ struct uncore_event {
  * @event:		Currently counting or sampling event
  * @box_type:		Pointer to the type of this box
  * @pdev:		PCI device of this box (For PCI type box)
+ * @prev_count:		Raw counter values seen last, see uncore_read_counter_delta()
+ * @total_count:	64-bit totals of counters since box init
  * @next:		List of the same type boxes
  *
  * Describe a single uncore pmu box instance. All boxes of the same type
@@ -97,6 +103,8 @@ struct uncore_box {
 	struct uncore_event	*event;
 	struct uncore_box_type	*box_type;
 	struct pci_dev		*pdev;
+	u64			prev_count[UNCORE_MAX_COUNTERS];
+	u64			total_count[UNCORE_MAX_COUNTERS];
 	struct list_head	next;
 };
 
@@ -112,9 +120,18 @@ struct uncore_box {
  * @read_counter:
  * @write_filter:
  * @read_filter:
+ * @ack_box:
+ * @enable_fixed:
+ * @read_fixed:
+ * @enable_event_idx:
+ * @disable_event_idx:
+ * @write_counter_idx:
+ * @read_counter_idx:
  *
  * Describe methods for manipulating a uncore PMU box. The methods are
  * microarchitecture specific. Some of them could be %NULL, e.g. read_filter.
+ * The methods without _idx always manipulate counter 0 of the box, the _idx
+ * ones manipulate the @idx'th counter.
  */
 struct uncore_box_ops {
 	void (*show_box)(struct uncore_box *box);
@@ -128,6 +145,13 @@ struct uncore_box_ops {
 	void (*read_counter)(struct uncore_box *box, u64 *value);
 	void (*write_filter)(struct uncore_box *box, u64 value);
 	void (*read_filter)(struct uncore_box *box, u64 *value);
+	u64 (*ack_box)(struct uncore_box *box);
+	void (*enable_fixed)(struct uncore_box *box, bool enable);
+	void (*read_fixed)(struct uncore_box *box, u64 *value);
+	void (*enable_event_idx)(struct uncore_box *box, unsigned int idx, struct uncore_event *event);
+	void (*disable_event_idx)(struct uncore_box *box, unsigned int idx, struct uncore_event *event);
+	void (*write_counter_idx)(struct uncore_box *box, unsigned int idx, u64 value);
+	void (*read_counter_idx)(struct uncore_box *box, unsigned int idx, u64 *value);
 };
 
 /**
@@ -183,6 +207,10 @@ struct uncore_box_type {
  * @global_ctl:		MSR address of global control register (per socket)
  * @global_status:	MSR address of global status register (per socket)
  * @global_config:	MSR address of global config register (per socket)
+ * @global_pmi_ctl:	Global control value routing overflow PMIs to a physical
+ *			core and un-freezing all boxes, 0 if @core can not get it.
+ *			@core is the dense index of the core in its socket, not
+ *			the APIC-derived core id, see uncore_pmu_core_index()
  *
  * This structure is the TOP description about UNCORE_PMU. The main reason to
  * have such a global description structure is sometimes we need to manipulate
@@ -198,6 +226,7 @@ struct uncore_pmu {
 	unsigned int		global_ctl;
 	unsigned int		global_status;
 	unsigned int		global_config;
+	u64			(*global_pmi_ctl)(unsigned int core);
 };
 
 extern unsigned int uncore_socket_number;
@@ -245,6 +274,19 @@ static inline unsigned int uncore_pci_perf_ctr(struct uncore_box *box)
 	return box->box_type->perf_ctr;
 }
 
+/* PCI type counters are 64-bit wide, control registers are 32-bit wide */
+static inline unsigned int uncore_pci_perf_ctl_idx(struct uncore_box *box,
+						   unsigned int idx)
+{
+	return box->box_type->perf_ctl + 4 * idx;
+}
+
+static inline unsigned int uncore_pci_perf_ctr_idx(struct uncore_box *box,
+						   unsigned int idx)
+{
+	return box->box_type->perf_ctr + 8 * idx;
+}
+
 /*
  * MSR Type Box
  */
@@ -269,6 +311,11 @@ static inline unsigned int uncore_msr_box_filter(struct uncore_box *box)
 	return box->box_type->box_filter0 + uncore_msr_box_offset(box);
 }
 
+static inline unsigned int uncore_msr_box_filter1(struct uncore_box *box)
+{
+	return box->box_type->box_filter1 + uncore_msr_box_offset(box);
+}
+
 static inline unsigned int uncore_msr_perf_ctl(struct uncore_box *box)
 {
 	return box->box_type->perf_ctl + uncore_msr_box_offset(box);
@@ -279,6 +326,18 @@ static inline unsigned int uncore_msr_perf_ctr(struct uncore_box *box)
 	return box->box_type->perf_ctr + uncore_msr_box_offset(box);
 }
 
+static inline unsigned int uncore_msr_perf_ctl_idx(struct uncore_box *box,
+						   unsigned int idx)
+{
+	return uncore_msr_perf_ctl(box) + idx;
+}
+
+static inline unsigned int uncore_msr_perf_ctr_idx(struct uncore_box *box,
+						   unsigned int idx)
+{
+	return uncore_msr_perf_ctr(box) + idx;
+}
+
 /******************************************************************************
  * Generic Uncore PMU Box's APIs
  *****************************************************************************/
@@ -286,6 +345,10 @@ static inline unsigned int uncore_msr_perf_ctr(struct uncore_box *box)
 void uncore_clear_global_pmu(struct uncore_pmu *pmu);
 void uncore_print_global_pmu(struct uncore_pmu *pmu);
 
+int uncore_pmu_enable_pmi(struct uncore_pmu *pmu);
+void uncore_pmu_disable_pmi(struct uncore_pmu *pmu);
+u64 uncore_pmu_ack_pmi(struct uncore_pmu *pmu);
+
 int first_online_cpu_of_node(unsigned int node);
 int uncore_call_function_on_node(unsigned int node, void (*func)(void *info), void *info, int wait);
 
@@ -338,6 +401,10 @@ static inline void uncore_init_box(struct uncore_box *box)
 {
 	if (box->box_type->ops->init_box)
 		box->box_type->ops->init_box(box);
+
+	/* Counters are 0 now, so are the deltas */
+	memset(box->prev_count, 0, sizeof(box->prev_count));
+	memset(box->total_count, 0, sizeof(box->total_count));
 }
 
 /**
@@ -352,6 +419,9 @@ static inline void uncore_clear_box(struct uncore_box *box)
 {
 	if (box->box_type->ops->clear_box)
 		box->box_type->ops->clear_box(box);
+
+	memset(box->prev_count, 0, sizeof(box->prev_count));
+	memset(box->total_count, 0, sizeof(box->total_count));
 }
 
 /**
@@ -440,6 +510,105 @@ static inline void uncore_read_counter(struct uncore_box *box, u64 *value)
 		box->box_type->ops->read_counter(box, value);
 }
 
+/**
+ * uncore_enable_event_idx
+ * @box:	the box to enable
+ * @idx:	the counter within the box
+ * @event:	the event to count or sample
+ *
+ * The same with uncore_enable_event, but assign @event to the @idx'th counter.
+ * Make sure the event is allowed on that counter (Register Restrictions).
+ */
+static inline void uncore_enable_event_idx(struct uncore_box *box,
+					   unsigned int idx,
+					   struct uncore_event *event)
+{
+	if (box->box_type->ops->enable_event_idx && idx < box->box_type->num_counters)
+		box->box_type->ops->enable_event_idx(box, idx, event);
+}
+
+/**
+ * uncore_disable_event_idx
+ * @box:	the box to disable
+ * @idx:	the counter within the box
+ * @event:	the event to disable
+ */
+static inline void uncore_disable_event_idx(struct uncore_box *box,
+					    unsigned int idx,
+					    struct uncore_event *event)
+{
+	if (box->box_type->ops->disable_event_idx && idx < box->box_type->num_counters)
+		box->box_type->ops->disable_event_idx(box, idx, event);
+}
+
+/**
+ * uncore_write_counter_idx
+ * @box:	the box to write
+ * @idx:	the counter within the box
+ * @value:	the value to write
+ *
+ * The next uncore_read_counter_delta() counts from @value on, e.g. a sampling
+ * preload does not show up as a huge delta.
+ */
+static inline void uncore_write_counter_idx(struct uncore_box *box,
+					    unsigned int idx, u64 value)
+{
+	if (box->box_type->ops->write_counter_idx && idx < box->box_type->num_counters) {
+		box->box_type->ops->write_counter_idx(box, idx, value);
+		box->prev_count[idx] = value & uncore_box_ctr_mask(box);
+	}
+}
+
+/**
+ * uncore_read_counter_idx
+ * @box:	the box to read
+ * @idx:	the counter within the box
+ * @value:	place to hold value
+ */
+static inline void uncore_read_counter_idx(struct uncore_box *box,
+					   unsigned int idx, u64 *value)
+{
+	if (box->box_type->ops->read_counter_idx && idx < box->box_type->num_counters)
+		box->box_type->ops->read_counter_idx(box, idx, value);
+}
+
+/**
+ * uncore_read_counter_delta
+ * @box:	the box to read
+ * @idx:	the counter within the box
+ * Return:	events counted since last call, 0 if @idx is invalid
+ *
+ * Free-running counting: the counter is never frozen, reset or written. The
+ * delta is taken modulo the counter width, so a wrap in between is fine as
+ * long as the counter does not wrap twice, which takes days with 48 bits.
+ * The delta is also added to the 64-bit total of this counter.
+ */
+static inline u64 uncore_read_counter_delta(struct uncore_box *box,
+					    unsigned int idx)
+{
+	u64 now, delta;
+
+	if (!box->box_type->ops->read_counter_idx || idx >= UNCORE_MAX_COUNTERS ||
+	    idx >= box->box_type->num_counters)
+		return 0;
+
+	box->box_type->ops->read_counter_idx(box, idx, &now);
+	delta = (now - box->prev_count[idx]) & uncore_box_ctr_mask(box);
+	box->prev_count[idx] = now;
+	box->total_count[idx] += delta;
+
+	return delta;
+}
+
+/* 64-bit total of a counter, see uncore_read_counter_delta() */
+static inline u64 uncore_read_counter_total(struct uncore_box *box,
+					    unsigned int idx)
+{
+	if (idx >= UNCORE_MAX_COUNTERS)
+		return 0;
+	return box->total_count[idx];
+}
+
 /**
  * uncore_write_filter
  * @box:	the box to write
@@ -467,6 +636,46 @@ static inline void uncore_read_filter(struct uncore_box *box, u64 *value)
 		box->box_type->ops->read_filter(box, value);
 }
 
+/**
+ * uncore_enable_fixed
+ * @box:	the box in question
+ * @enable:	start or stop the fixed counter
+ *
+ * The fixed counter (e.g. UCLK of U-Box, DCLK of IMC) counts clockticks and
+ * needs no event. Boxes without one ignore this.
+ */
+static inline void uncore_enable_fixed(struct uncore_box *box, bool enable)
+{
+	if (box->box_type->ops->enable_fixed && box->box_type->fixed_ctl)
+		box->box_type->ops->enable_fixed(box, enable);
+}
+
+/**
+ * uncore_read_fixed
+ * @box:	the box to read
+ * @value:	place to hold value, 0 if the box has no fixed counter
+ */
+static inline void uncore_read_fixed(struct uncore_box *box, u64 *value)
+{
+	*value = 0;
+	if (box->box_type->ops->read_fixed && box->box_type->fixed_ctr)
+		box->box_type->ops->read_fixed(box, value);
+}
+
+/**
+ * uncore_ack_box
+ * @box:	the box to acknowledge
+ * Return:	overflow bits of the box before clearing, one bit per counter
+ *
+ * Read and clear the overflow status of this box.
+ */
+static inline u64 uncore_ack_box(struct uncore_box *box)
+{
+	if (box->box_type->ops->ack_box)
+		return box->box_type->ops->ack_box(box);
+	return 0;
+}
+
 /******************************************************************************
  * /proc Part
  *****************************************************************************/
@@ -481,29 +690,60 @@ void uncore_proc_remove(void);
 /**
  * struct uncore_imc_ops
  * @set_threshold:
+ * @threshold_to_raw:	Raw value set_threshold() writes for a ratio, optional
+ * @set_raw_threshold:	Write the throttle register field as is
  * @enable_throttle:
  * @disable_throttle:
+ * @raw_threshold_max:	Raw value of full bandwidth
  *
  * CPU specific methods to manipulate a single IMC.
  */
 struct uncore_imc_ops {
 	int	(*set_threshold)(struct pci_dev *pdev, unsigned int threshold);
+	unsigned int (*threshold_to_raw)(unsigned int threshold);
+	int	(*set_raw_threshold)(struct pci_dev *pdev, unsigned int raw);
 	int	(*enable_throttle)(struct pci_dev *pdev);
 	void	(*disable_throttle)(struct pci_dev *pdev);
+	unsigned int raw_threshold_max;
+};
+
+#define UNCORE_IMC_ALL_CHANNELS	(~0U)
+
+#define UNCORE_IMC_BW_POINTS	16
+
+/**
+ * struct uncore_imc_bw_table
+ * @nr:		Number of points
+ * @raw:	Raw thresholds, ascending
+ * @mbps:	Bandwidth measured at each of @raw, never descending
+ *
+ * What a raw threshold really gives on one node of this machine.
+ */
+struct uncore_imc_bw_table {
+	unsigned int nr;
+	unsigned int raw[UNCORE_IMC_BW_POINTS];
+	unsigned long mbps[UNCORE_IMC_BW_POINTS];
 };
 
 /**
  * struct uncore_imc
  * @nodeid:	Physcial node this imc on
+ * @channel:	Channel index within @nodeid, in device id order
+ * @threshold:	Throttle ratio last set, 1 if never
+ * @raw:	Raw threshold last set, 0 if set by @threshold
  * @list:	Point to next imc device
  * @pdev:	the pci device instance
  * @ops:	Methods to manipulate IMC
  *
  * This structure describes the IMC device used in uncore. We have this
  * one mainly because we want to control the bandwith more convenient. 
+ * Each device is one channel, and is throttled on its own.
  */
 struct uncore_imc {
 	unsigned int nodeid;
+	unsigned int channel;
+	unsigned int threshold;
+	unsigned int raw;
 	struct list_head next;
 	struct pci_dev *pdev;
 	const struct uncore_imc_ops *ops;
@@ -518,6 +758,19 @@ void uncore_imc_exit(void);
 void uncore_print_imc_devices(void);
 
 int uncore_imc_set_threshold(unsigned int nodeid, unsigned int threshold);
+unsigned int uncore_imc_bw_to_threshold(unsigned long peak_mbps, unsigned long mbps);
+int uncore_imc_set_raw_threshold(unsigned int nodeid, unsigned int raw);
+int uncore_imc_set_channel_threshold(unsigned int nodeid, unsigned int channel,
+				     unsigned int threshold);
+int uncore_imc_set_channel_raw_threshold(unsigned int nodeid, unsigned int channel,
+					 unsigned int raw);
+unsigned int uncore_imc_nr_channels(unsigned int nodeid);
+unsigned int uncore_imc_raw_threshold_max(void);
+unsigned int uncore_imc_threshold_to_raw(unsigned int threshold);
+int uncore_imc_set_bw_table(unsigned int nodeid, const struct uncore_imc_bw_table *table);
+const struct uncore_imc_bw_table *uncore_imc_get_bw_table(unsigned int nodeid);
+unsigned int uncore_imc_bw_to_raw(unsigned int nodeid, unsigned long mbps);
+unsigned long uncore_imc_raw_to_bw(unsigned int nodeid, unsigned int raw);
 int uncore_imc_enable_throttle(unsigned int nodeid);
 void uncore_imc_disable_throttle(unsigned int nodeid);
 
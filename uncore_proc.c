@@ -22,18 +22,56 @@
 
 #include <asm/uaccess.h>
 
+#include <linux/ctype.h>
 #include <linux/errno.h>
 #include <linux/types.h>
 #include <linux/mutex.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/nodemask.h>
 #include <linux/proc_fs.h>
 #include <linux/seq_file.h>
 
-static int bw_ratio = 1;
 static DEFINE_MUTEX(uncore_proc_mutex);
 
+/* State lives in the IMC devices, so throttling by emulate_nvm shows too */
 static int pmu_proc_show(struct seq_file *file, void *v)
 {
-	seq_printf(file, "Bandwidth Throttling Ratio: 1/%d", bw_ratio);
+	const struct uncore_imc_bw_table *table;
+	unsigned int nr_channels;
+	struct uncore_imc *imc;
+	int node;
+
+	for_each_online_node(node) {
+		if (node >= UNCORE_MAX_SOCKET)
+			break;
+		nr_channels = uncore_imc_nr_channels(node);
+		if (!nr_channels)
+			continue;
+
+		table = uncore_imc_get_bw_table(node);
+		if (table)
+			seq_printf(file, "Node %d: %u channels, calibrated, %lu MB/s peak\n",
+				node, nr_channels, table->mbps[table->nr - 1]);
+		else
+			seq_printf(file, "Node %d: %u channels, not calibrated\n",
+				node, nr_channels);
+
+		list_for_each_entry(imc, &uncore_imc_devices, next) {
+			if (imc->nodeid != node)
+				continue;
+			if (imc->raw && table)
+				seq_printf(file, "        Channel %u: THRT_PWR 0x%03x, "
+					"%lu MB/s expected\n", imc->channel, imc->raw,
+					uncore_imc_raw_to_bw(node, imc->raw) / nr_channels);
+			else if (imc->raw)
+				seq_printf(file, "        Channel %u: THRT_PWR 0x%03x\n",
+					imc->channel, imc->raw);
+			else
+				seq_printf(file, "        Channel %u: Bandwidth Throttling Ratio 1/%u\n",
+					imc->channel, imc->threshold);
+		}
+	}
 	
 	return 0;
 }
@@ -43,43 +81,181 @@ static int uncore_proc_open(struct inode *inode, struct file *file)
 	return single_open(file, pmu_proc_show, NULL);
 }
 
+/* Bandwidth as written, before it meets a node */
+enum uncore_proc_unit {
+	UNCORE_PROC_RATIO,
+	UNCORE_PROC_PERCENT,
+	UNCORE_PROC_MBPS,
+};
+
+/*
+ * "2", "30%", "12.5G" or "12500M". The value is in 1/1000 of the unit,
+ * so GB/s come out as MB/s.
+ */
+static int uncore_proc_parse_bw(const char *s, enum uncore_proc_unit *unit,
+				unsigned long *val)
+{
+	unsigned long whole, frac = 0, scale = 1000;
+	char *end;
+
+	whole = simple_strtoul(s, &end, 10);
+	if (end == s)
+		return -EINVAL;
+
+	if (*end == '.') {
+		for (end++; isdigit(*end); end++) {
+			if (scale == 1)
+				continue;
+			scale /= 10;
+			frac += (*end - '0') * scale;
+		}
+	}
+	*val = whole * 1000 + frac;
+
+	switch (*end) {
+		case '%':
+			*unit = UNCORE_PROC_PERCENT;
+			end++;
+			break;
+		case 'G': case 'g':
+			*unit = UNCORE_PROC_MBPS;
+			end++;
+			break;
+		case 'M': case 'm':
+			*unit = UNCORE_PROC_MBPS;
+			*val /= 1000;
+			end++;
+			break;
+		default:
+			if (frac)
+				return -EINVAL;
+			*unit = UNCORE_PROC_RATIO;
+			*val = whole;
+	}
+
+	if (*end && !isspace(*end))
+		return -EINVAL;
+
+	/*
+	 * No throttle gives more than the peak, and none gives nothing. 0%
+	 * would be full bandwidth on a node not calibrated, and the slowest
+	 * raw value on a calibrated one.
+	 */
+	if (*unit == UNCORE_PROC_PERCENT && (!*val || *val > 100 * 1000))
+		return -EINVAL;
+	return 0;
+}
+
+/*
+ * Any bandwidth within the raw threshold range, as measured by calibration.
+ * A node not calibrated only has the ratios, percents pick the closest one.
+ * The table is of the whole node, a single @channel gets its share.
+ */
+static int uncore_proc_set_bw(int node, unsigned int channel,
+			      enum uncore_proc_unit unit, unsigned long val)
+{
+	const struct uncore_imc_bw_table *table;
+	unsigned long mbps;
+
+	if (unit == UNCORE_PROC_RATIO) {
+		if (val == 0)
+			val = 1;
+		if (val != 1 && val != 2 && val != 4)
+			return -EINVAL;
+		return uncore_imc_set_channel_threshold(node, channel, val);
+	}
+
+	table = uncore_imc_get_bw_table(node);
+	if (!table) {
+		if (unit == UNCORE_PROC_MBPS)
+			return -ENODATA;
+		return uncore_imc_set_channel_threshold(node, channel,
+			uncore_imc_bw_to_threshold(100000, val));
+	}
+
+	mbps = val;
+	if (unit == UNCORE_PROC_PERCENT)
+		mbps = table->mbps[table->nr - 1] * val / 100000;
+	else if (channel != UNCORE_IMC_ALL_CHANNELS)
+		mbps *= uncore_imc_nr_channels(node);
+
+	return uncore_imc_set_channel_raw_threshold(node, channel,
+		uncore_imc_bw_to_raw(node, mbps));
+}
+
 /*
- * Control behaviour of the underlying module in a predefined manner
+ * Control behaviour of the underlying module in a predefined manner:
+ *
+ *	echo 2 > /proc/uncore_pmu	1/2 bandwidth on all nodes
+ *	echo 3 4 > /proc/uncore_pmu	1/4 bandwidth on node 3 only
+ *	echo 3:1 4 > /proc/uncore_pmu	1/4 bandwidth on channel 1 of node 3
+ *	echo 3 15% > /proc/uncore_pmu	15% of calibrated peak on node 3
+ *	echo 3 9.6G > /proc/uncore_pmu	9.6 GB/s on node 3
+ *	echo 3 9600M > /proc/uncore_pmu	the same
+ *
+ * Ratio is 1, 2 or 4. 0 still means 1, as it always did. GB/s and MB/s need
+ * a calibrated node (bw_calibrate or bw_table of emulate_nvm), reading the
+ * file tells the bandwidth calibration expects there, it is not measured
+ * (/proc/emulate_nvm has the CAS bandwidth of NVM nodes, when it counts).
+ * Percents are above 0 and up to 100. Nodes and channels not written to keep what they
+ * have, full bandwidth unless told otherwise.
  */
 static ssize_t uncore_proc_write(struct file *file, const char __user *buf,
 				 size_t count,  loff_t *offs)
 {
-	char ctl[2];
+	char ctl[32], first[16], arg[16];
+	unsigned int channel = UNCORE_IMC_ALL_CHANNELS;
+	enum uncore_proc_unit unit;
+	unsigned long val;
+	int node, ret = 0;
 	
-	if (count !=2 || *offs)
+	if (!count || count >= sizeof(ctl) || *offs)
 		return -EINVAL;
 	
 	if (copy_from_user(ctl, buf, count))
 		return -EFAULT;
-	
-	mutex_lock(&uncore_proc_mutex);
-	switch (ctl[0]) {
-		case '0':/* 1/1 Bandwidth */
-			bw_ratio = 1;
-			uncore_imc_set_threshold(0, 1);
-			uncore_imc_set_threshold(1, 1);
-			break;
-		case '2':/* 1/2 Bandwidth */
-			bw_ratio = 2;
-			uncore_imc_set_threshold(0, 2);
-			uncore_imc_set_threshold(1, 2);
+	ctl[count] = '\0';
+
+	switch (sscanf(ctl, "%15s %15s", first, arg)) {
+		case 1:
+			strcpy(arg, first);
+			node = -1;
 			break;
-		case '4':/* 1/4 Bandwidth */
-			bw_ratio = 4;
-			uncore_imc_set_threshold(0, 4);
-			uncore_imc_set_threshold(1, 4);
+		case 2:
+			if (sscanf(first, "%d:%u", &node, &channel) < 1 ||
+			    node < 0 || node >= UNCORE_MAX_SOCKET ||
+			    !node_online(node))
+				return -EINVAL;
+			if (channel != UNCORE_IMC_ALL_CHANNELS &&
+			    channel >= uncore_imc_nr_channels(node))
+				return -EINVAL;
 			break;
 		default:
-			count = -EINVAL;
+			return -EINVAL;
+	}
+
+	ret = uncore_proc_parse_bw(arg, &unit, &val);
+	if (ret)
+		return ret;
+	
+	mutex_lock(&uncore_proc_mutex);
+	if (node >= 0)
+		ret = uncore_proc_set_bw(node, channel, unit, val);
+	else {
+		for_each_online_node(node) {
+			if (node >= UNCORE_MAX_SOCKET)
+				break;
+			/* Nodes without IMC (e.g. memory-less) are skipped */
+			ret = uncore_proc_set_bw(node, channel, unit, val);
+			if (ret == -ENXIO)
+				ret = 0;
+			if (ret)
+				break;
+		}
 	}
 	mutex_unlock(&uncore_proc_mutex);
 
-	return count;
+	return ret ? ret : count;
 }
 
 const struct file_operations uncore_proc_fops = {